@@ -2,56 +2,652 @@
 //  ./Main.exe
 #include <raylib.h>
 #include <raymath.h>
+#include <external/sdefl.h> // DEFLATE codec bundled with raylib; the library already contains its implementation
+#include <external/sinfl.h>
 #include <iostream>
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <cstdio>
+#include <type_traits>
+#include <deque>
+#include <memory>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <new>
+#endif
 
-const int WINDOW_WIDTH = 1280;
+const int WINDOW_WIDTH = 1280; // starting window size, and the default world
 const int WINDOW_HEIGHT = 720;
 const float FPS = 60;
-const float TIMESTEP = 1 / FPS;
-const int cellSize = 50;
+float TIMESTEP = 1 / FPS; // physics step, set once from --physics-rate before the first step
+const float DEFAULT_CELL_SIZE = 50.0f; // the grid can be retuned at runtime; see CellSizeTuner
+const float CONTACT_MARGIN = 1.0f; // contacts are kept a little before balls touch so resting stacks do not flicker
+const float MAX_BALL_RADIUS = 25.0f; // no ball is larger; spatial queries widen their cell range by this
 
+thread_local bool insideWorkerPool = false;
+int workerThreadCount = 0; // 0 uses one thread per core; must be set before the pool is first used
+
+// A fixed set of threads that split index ranges between them; nested or concurrent calls run on the caller.
+// Tasks only write results owned by their own indices, so any thread count gives the same bits.
+struct WorkerPool
+{
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::mutex callMutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(int, int)> *task = nullptr;
+    int count = 0;
+    int generation = 0;
+    int pending = 0;
+    bool stopping = false;
+
+    explicit WorkerPool(int threadCount){
+        for(int i = 1; i < threadCount; i++){
+            threads.emplace_back([this, i]{ workerLoop(i); });
+        }
+    }
+
+    ~WorkerPool(){
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for(std::thread &thread : threads){
+            thread.join();
+        }
+    }
+
+    int size() const {
+        return threads.size() + 1;
+    }
+
+    static void runChunk(const std::function<void(int, int)> &task, int count, int chunk, int chunkCount){
+        int begin = (long long)count * chunk / chunkCount;
+        int end = (long long)count * (chunk + 1) / chunkCount;
+        if(begin < end){
+            task(begin, end);
+        }
+    }
+
+    void workerLoop(int index){
+        insideWorkerPool = true;
+        int seen = 0;
+        while(true){
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&]{ return stopping || generation != seen; });
+            if(stopping){
+                return;
+            }
+            seen = generation;
+            lock.unlock();
+            runChunk(*task, count, index, size());
+            lock.lock();
+            if(--pending == 0){
+                done.notify_one();
+            }
+        }
+    }
+
+    // Runs task(begin, end) over [0, count), one contiguous chunk per thread, and waits for all of them.
+    void parallelFor(int count, const std::function<void(int, int)> &task){
+        if(threads.empty() || count < 2 || insideWorkerPool || !callMutex.try_lock()){
+            task(0, count);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            this->task = &task;
+            this->count = count;
+            pending = threads.size();
+            generation++;
+        }
+        wake.notify_all();
+        insideWorkerPool = true;
+        runChunk(task, count, 0, size());
+        insideWorkerPool = false;
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&]{ return pending == 0; });
+        callMutex.unlock();
+    }
+};
+
+WorkerPool &workerPool(){
+    static WorkerPool pool(workerThreadCount > 0 ? workerThreadCount : std::max(1u, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+// Hot simulation data: everything the physics step reads and writes every frame.
 struct Ball
 {
     Vector2 position;
+    Vector2 velocity;
     float radius;
+    float inverse_mass;
+    int sleepCounter; // consecutive steps spent below SimulationSettings::sleepVelocity
+};
+
+// Compact render attributes: palette-indexed color and 8.8 fixed point radius.
+struct BallRender
+{
+    uint16_t radius;
+    uint8_t paletteIndex;
+};
+
+// Cold data: only touched when spawning or when drawing with exact colors.
+struct BallInfo
+{
     Color color;
-    int index;
     float mass;
-    float inverse_mass;
-    Vector2 velocity;
+    uint32_t slot;       // handle slot that refers to this ball, see BallHandles
+    uint32_t generation;
+    int spawnInstance;
+    int expireStep;      // step the ball is despawned on, 0 for never
+};
+
+enum SolverMode
+{
+    SOLVER_SINGLE_IMPULSE,      // one impulse per pair as the grid is walked
+    SOLVER_SEQUENTIAL_IMPULSE,  // warm-started iterations over all contacts of the step
+    SOLVER_XPBD,                // substepped projection of overlap constraints on positions
+    SOLVER_MODE_COUNT
+};
+
+struct SimulationSettings
+{
+    float elasticityCoefficient = 1.0f;
+    bool gravityEnabled = false;
+    Vector2 gravity = {0.0f, 980.0f};
+    float linearDamping = 0.0f;         // fraction of velocity lost per second
+    float restitutionThreshold = 0.0f;  // contacts slower than this do not bounce
+    float positionCorrection = 0.0f;    // fraction of overlap pushed apart each step
+    bool sleepEnabled = false;
+    float sleepVelocity = 20.0f;
+    float wakeVelocity = 60.0f;         // approach speed needed to wake a sleeping ball
+    int sleepSteps = 30;
+    bool continuousCollision = true;
+    float continuousCollisionThreshold = 1.0f; // swept tests for balls moving more than this many radii per step
+    SolverMode solver = SOLVER_SINGLE_IMPULSE;
+    int solverIterations = 8;
+    bool warmStarting = true;
+    bool nBodyGravity = false;
+    float gravitationalConstant = 5000.0f;
+    float openingAngle = 0.5f;         // Barnes-Hut: a node is used whole when its size over its distance is below this
+    float softening = 5.0f;
+    bool fluid = false;                // balls are SPH particles instead of rigid bodies
+    float fluidSmoothingLength = 30.0f;  // kernel radius
+    float fluidRestDensity = 0.005f;   // mass per square pixel
+    float fluidStiffness = 500000.0f;
+    float fluidViscosity = 1.0f;
+    float maxSpeed = 0.0f;             // 0 for no limit
+    int xpbdSubsteps = 8;
+    float xpbdCompliance = 0.0f;       // inverse stiffness of the overlap constraints, 0 is rigid
+    Vector2 world = {WINDOW_WIDTH, WINDOW_HEIGHT}; // walled area, from the origin; follows the window unless fixed
+};
+
+// Union-find over touching balls; waking one sleeper wakes its whole island.
+struct SleepIslands
+{
+    std::vector<int> parent;
+    std::vector<int> scratch;
+    std::vector<int> wokenIslands;
+};
+
+struct Contact
+{
+    int a;
+    int b;              // other ball, or a negative wall id
+    Vector2 normal;     // from b towards a
+    float inverseMass1;
+    float inverseMass2;
+    float normalMass;
+    float bias;         // separating velocity the solver aims for
+    float bounceSpeed;  // separating velocity restitution asks for once the contact is solved
+    float impulse;      // accumulated over the iterations, warm-started from the cache
+};
+
+struct QuadNode
+{
+    Vector2 center;        // of the square the node covers
+    float halfSize;
+    Vector2 centerOfMass;
+    float mass;
+    int firstChild;        // first of four consecutive children, -1 for a leaf
+    int firstBody;         // leaves: range in QuadTree::bodies
+    int bodyCount;
+};
+
+struct QuadTree
+{
+    std::vector<QuadNode> nodes;
+    std::vector<int> bodies;        // ball indices, grouped by leaf
+    std::vector<std::vector<QuadNode>> subtrees;
+};
+
+struct CollisionEvent
+{
+    int a;
+    int b;
+    Vector2 position; // contact point
+    Vector2 normal;   // from b towards a
+    float impulse;
+    int step;
+};
+
+// Lock-free single-producer single-consumer queue of collision events; overflow is counted as dropped.
+struct CollisionEventRing
+{
+    std::vector<CollisionEvent> slots; // power of two sized, allocated once
+    uint64_t mask;
+    float minimumImpulse; // weaker contacts are never queued
+    int step = 0;         // stamped on events as they are pushed
+    alignas(64) std::atomic<uint64_t> head{0}; // next slot to write, stored only by the producer
+    alignas(64) std::atomic<uint64_t> tail{0}; // next slot to read, stored only by the consumer
+    alignas(64) uint64_t cachedTail = 0;       // producer's last look at tail, so a push rarely touches the consumer's line
+    std::atomic<uint64_t> dropped{0};
+
+    CollisionEventRing(int capacity, float minimumImpulse) : minimumImpulse(minimumImpulse) {
+        int size = 1;
+        while(size < capacity){
+            size *= 2;
+        }
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    void push(int a, int b, Vector2 position, Vector2 normal, float impulse){
+        uint64_t index = head.load(std::memory_order_relaxed);
+        if(index - cachedTail >= slots.size()){
+            cachedTail = tail.load(std::memory_order_acquire);
+            if(index - cachedTail >= slots.size()){
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+        }
+        slots[index & mask] = CollisionEvent{a, b, position, normal, impulse, step};
+        head.store(index + 1, std::memory_order_release);
+    }
+
+    // Calls consume(event) for everything queued so far and returns how many there were.
+    template <typename Consumer>
+    int drain(Consumer consume){
+        uint64_t index = tail.load(std::memory_order_relaxed);
+        uint64_t end = head.load(std::memory_order_acquire);
+        for(uint64_t i = index; i < end; i++){
+            consume(slots[i & mask]);
+        }
+        tail.store(end, std::memory_order_release);
+        return end - index;
+    }
+};
+
+// Queues a contact between two balls if it was hard enough; events may be null when nobody listens.
+void emitCollisionEvent(CollisionEventRing *events, int a, int b, Vector2 position, Vector2 normal, float impulse){
+    if(events != nullptr && impulse >= events->minimumImpulse){
+        events->push(a, b, position, normal, impulse);
+    }
+}
+
+Vector2 componentMin(Vector2 a, Vector2 b){
+    return Vector2{std::min(a.x, b.x), std::min(a.y, b.y)};
+}
+
+Vector2 componentMax(Vector2 a, Vector2 b){
+    return Vector2{std::max(a.x, b.x), std::max(a.y, b.y)};
+}
+
+struct Obstacle
+{
+    int firstVertex;
+    int vertexCount; // 2 for a segment, otherwise a convex polygon with positive signed area
+    Vector2 min;
+    Vector2 max;
+};
+
+struct ObstacleNode
+{
+    Vector2 min;
+    Vector2 max;
+    int first; // leaf: first entry in StaticGeometry::order
+    int count; // leaf: obstacles in it, 0 for an inner node
+    int left;  // inner node children
+    int right;
+};
+
+// Static level geometry: segments and convex polygons in a bounding volume hierarchy built once.
+struct StaticGeometry
+{
+    static const int LEAF_SIZE = 4;
+    std::vector<Vector2> vertices;
+    std::vector<Obstacle> obstacles;
+    std::vector<ObstacleNode> nodes; // root first; empty until build
+    std::vector<int> order;          // obstacle indices grouped by leaf
+
+    void addObstacle(const Vector2 *points, int count){
+        Obstacle obstacle;
+        obstacle.firstVertex = vertices.size();
+        obstacle.vertexCount = count;
+        obstacle.min = points[0];
+        obstacle.max = points[0];
+        for(int i = 0; i < count; i++){
+            vertices.push_back(points[i]);
+            obstacle.min = componentMin(obstacle.min, points[i]);
+            obstacle.max = componentMax(obstacle.max, points[i]);
+        }
+        obstacles.push_back(obstacle);
+    }
+
+    void addSegment(Vector2 a, Vector2 b){
+        Vector2 points[2] = {a, b};
+        addObstacle(points, 2);
+    }
+
+    void addRectangle(Rectangle rectangle){
+        Vector2 points[4] = {{rectangle.x, rectangle.y}, {rectangle.x + rectangle.width, rectangle.y},
+                             {rectangle.x + rectangle.width, rectangle.y + rectangle.height}, {rectangle.x, rectangle.y + rectangle.height}};
+        addObstacle(points, 4);
+    }
+
+    // Either winding is accepted. Returns false, adding nothing, if the points do not form a convex polygon.
+    bool addPolygon(std::vector<Vector2> points){
+        int count = points.size();
+        if(count < 3){
+            return false;
+        }
+        float area = 0.0f;
+        for(int i = 0; i < count; i++){
+            Vector2 a = points[i];
+            Vector2 b = points[(i + 1) % count];
+            area += a.x * b.y - b.x * a.y;
+        }
+        if(area < 0.0f){
+            std::reverse(points.begin(), points.end());
+        }
+        for(int i = 0; i < count; i++){
+            Vector2 edge = Vector2Subtract(points[(i + 1) % count], points[i]);
+            Vector2 next = Vector2Subtract(points[(i + 2) % count], points[(i + 1) % count]);
+            if(edge.x * next.y - edge.y * next.x < 0.0f){
+                return false;
+            }
+        }
+        addObstacle(points.data(), count);
+        return true;
+    }
+
+    // Splits at the median of the longer axis until leaves hold LEAF_SIZE obstacles or fewer.
+    int buildNode(int first, int count){
+        ObstacleNode node;
+        node.min = obstacles[order[first]].min;
+        node.max = obstacles[order[first]].max;
+        Vector2 centerMin = Vector2Scale(Vector2Add(node.min, node.max), 0.5f);
+        Vector2 centerMax = centerMin;
+        for(int i = first; i < first + count; i++){
+            const Obstacle &obstacle = obstacles[order[i]];
+            node.min = componentMin(node.min, obstacle.min);
+            node.max = componentMax(node.max, obstacle.max);
+            Vector2 center = Vector2Scale(Vector2Add(obstacle.min, obstacle.max), 0.5f);
+            centerMin = componentMin(centerMin, center);
+            centerMax = componentMax(centerMax, center);
+        }
+        node.first = first;
+        node.count = count;
+        node.left = -1;
+        node.right = -1;
+        int index = nodes.size();
+        nodes.push_back(node);
+        if(count <= LEAF_SIZE){
+            return index;
+        }
+        bool splitX = centerMax.x - centerMin.x >= centerMax.y - centerMin.y;
+        int half = count / 2;
+        std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count, [&](int a, int b){
+            const Obstacle &oa = obstacles[a];
+            const Obstacle &ob = obstacles[b];
+            return splitX ? oa.min.x + oa.max.x < ob.min.x + ob.max.x : oa.min.y + oa.max.y < ob.min.y + ob.max.y;
+        });
+        int left = buildNode(first, half);
+        int right = buildNode(first + half, count - half);
+        nodes[index].count = 0;
+        nodes[index].left = left;
+        nodes[index].right = right;
+        return index;
+    }
+
+    void build(){
+        nodes.clear();
+        order.resize(obstacles.size());
+        for(int i = 0; i < order.size(); i++){
+            order[i] = i;
+        }
+        if(!obstacles.empty()){
+            buildNode(0, obstacles.size());
+        }
+    }
+};
+
+// Calls obstacleFunction(o) for every obstacle whose box overlaps the box from min to max.
+template <typename ObstacleFunction>
+void forEachObstacleNear(const StaticGeometry &geometry, Vector2 min, Vector2 max, ObstacleFunction obstacleFunction){
+    if(geometry.nodes.empty()){
+        return;
+    }
+    int stack[64]; // median splits keep the depth near log2 of the obstacle count
+    int top = 0;
+    stack[top++] = 0;
+    while(top > 0){
+        const ObstacleNode &node = geometry.nodes[stack[--top]];
+        if(node.max.x < min.x || node.min.x > max.x || node.max.y < min.y || node.min.y > max.y){
+            continue;
+        }
+        if(node.count == 0){
+            stack[top++] = node.left;
+            stack[top++] = node.right;
+            continue;
+        }
+        for(int i = node.first; i < node.first + node.count; i++){
+            const Obstacle &obstacle = geometry.obstacles[geometry.order[i]];
+            if(obstacle.max.x >= min.x && obstacle.min.x <= max.x && obstacle.max.y >= min.y && obstacle.min.y <= max.y){
+                obstacleFunction(geometry.order[i]);
+            }
+        }
+    }
+}
+
+Vector2 closestPointOnSegment(Vector2 point, Vector2 a, Vector2 b){
+    Vector2 edge = Vector2Subtract(b, a);
+    float lengthSq = Vector2LengthSqr(edge);
+    float t = lengthSq > 0.0f ? Clamp(Vector2DotProduct(Vector2Subtract(point, a), edge) / lengthSq, 0.0f, 1.0f) : 0.0f;
+    return Vector2Add(a, Vector2Scale(edge, t));
+}
 
+float cross(Vector2 a, Vector2 b){
+    return a.x * b.y - a.y * b.x;
+}
 
-    bool operator==(const Ball& ball){
-        return(
-            this->position.x == ball.position.x &&
-            this->position.y == ball.position.y &&
-            this->radius == ball.radius &&
-            this->index == ball.index &&
-            this->mass == ball.mass
-        );
+// Whether a circle overlaps obstacle o, and the push that clears it; from picks the side of a segment.
+bool obstacleContact(const StaticGeometry &geometry, int o, Vector2 center, float radius, Vector2 from, Vector2 &normal, float &depth){
+    const Obstacle &obstacle = geometry.obstacles[o];
+    const Vector2 *points = &geometry.vertices[obstacle.firstVertex];
+    if(obstacle.vertexCount == 2){
+        Vector2 a = points[0];
+        Vector2 b = points[1];
+        Vector2 edge = Vector2Subtract(b, a);
+        Vector2 motion = Vector2Subtract(center, from);
+        float sideBefore = cross(edge, Vector2Subtract(from, a));
+        float sideNow = cross(edge, Vector2Subtract(center, a));
+        bool crossed = (sideBefore > 0.0f) != (sideNow > 0.0f) && sideBefore != 0.0f &&
+                       (cross(motion, Vector2Subtract(a, from)) > 0.0f) != (cross(motion, Vector2Subtract(b, from)) > 0.0f);
+        Vector2 closest = closestPointOnSegment(center, a, b);
+        Vector2 offset = Vector2Subtract(center, closest);
+        float distanceSq = Vector2LengthSqr(offset);
+        if(!crossed && distanceSq >= radius * radius){
+            return false;
+        }
+        float distance = std::sqrt(distanceSq);
+        if(distance > 0.0001f){
+            normal = Vector2Scale(offset, 1.0f / distance);
+        }
+        else{
+            normal = Vector2Normalize(Vector2{-edge.y, edge.x});
+            if(cross(edge, Vector2Subtract(from, a)) < 0.0f){
+                normal = Vector2Negate(normal);
+            }
+        }
+        if(crossed){
+            normal = Vector2Negate(normal);
+            depth = radius + distance;
+        }
+        else{
+            depth = radius - distance;
+        }
+        return true;
     }
 
-    bool operator!=(const Ball& ball){
-        return(
-            this->position.x != ball.position.x &&
-            this->position.y != ball.position.y &&
-            this->radius != ball.radius &&
-            this->index != ball.index &&
-            this->mass != ball.mass
-        );
+    // deepest face first: a center inside the polygon leaves through the nearest face
+    int count = obstacle.vertexCount;
+    float separation = -INFINITY;
+    Vector2 faceNormal = {0.0f, 0.0f};
+    for(int i = 0; i < count; i++){
+        Vector2 a = points[i];
+        Vector2 b = points[(i + 1) % count];
+        Vector2 n = Vector2Normalize(Vector2{b.y - a.y, a.x - b.x});
+        float s = Vector2DotProduct(Vector2Subtract(center, a), n);
+        if(s >= radius){
+            return false;
+        }
+        if(s > separation){
+            separation = s;
+            faceNormal = n;
+        }
+    }
+    if(separation <= 0.0f){
+        normal = faceNormal;
+        depth = radius - separation;
+        return true;
+    }
+    float nearestSq = INFINITY;
+    Vector2 nearest = {0.0f, 0.0f};
+    for(int i = 0; i < count; i++){
+        Vector2 closest = closestPointOnSegment(center, points[i], points[(i + 1) % count]);
+        float distanceSq = Vector2DistanceSqr(center, closest);
+        if(distanceSq < nearestSq){
+            nearestSq = distanceSq;
+            nearest = closest;
+        }
     }
+    if(nearestSq >= radius * radius){
+        return false;
+    }
+    float distance = std::sqrt(nearestSq);
+    normal = Vector2Scale(Vector2Subtract(center, nearest), 1.0f / distance);
+    depth = radius - distance;
+    return true;
+}
+
+struct PhysicsState
+{
+    SleepIslands islands;
+    std::vector<Contact> contacts;
+    std::unordered_map<uint64_t, float> contactCache; // accumulated impulse of last step's contacts, keyed by pair
+    QuadTree quadTree;
+    std::vector<Vector2> forces;                        // per ball, from attraction and fluid pressure; empty when unused
+    std::vector<float> fluidDensities;
+    std::vector<float> fluidPressures;
+    std::vector<Vector2> previousPositions;             // XPBD substep start, or step start when there are obstacles
+    std::vector<Vector2> previousVelocities;
+    std::unique_ptr<CollisionEventRing> events;         // null unless someone consumes collision events
+    StaticGeometry obstacles;                           // built before the first step and never changed after
 };
 
+uint64_t contactKey(int a, int b){
+    return ((uint64_t)(uint32_t)a << 32) | (uint32_t)b;
+}
+
+SimulationSettings gravityModeSettings(){
+    SimulationSettings settings;
+    settings.elasticityCoefficient = 0.5f;
+    settings.gravityEnabled = true;
+    settings.linearDamping = 0.5f;
+    settings.restitutionThreshold = 40.0f;
+    settings.positionCorrection = 0.2f;
+    settings.sleepEnabled = true;
+    settings.solver = SOLVER_SEQUENTIAL_IMPULSE;
+    return settings;
+}
+
+bool isAsleep(const Ball &ball, const SimulationSettings &settings){
+    return settings.sleepEnabled && ball.sleepCounter >= settings.sleepSteps;
+}
+
+int findIsland(SleepIslands &islands, int i){
+    while(islands.parent[i] != i){
+        islands.parent[i] = islands.parent[islands.parent[i]];
+        i = islands.parent[i];
+    }
+    return i;
+}
+
+void joinIslands(SleepIslands &islands, int a, int b){
+    a = findIsland(islands, a);
+    b = findIsland(islands, b);
+    if(a != b){
+        islands.parent[std::max(a, b)] = std::min(a, b);
+    }
+}
+
+Color ballPalette[256];
+
+void initializeBallPalette(){ // 6 x 7 x 6 color cube, the remaining entries stay black
+    for(int r = 0; r < 6; r++){
+        for(int g = 0; g < 7; g++){
+            for(int b = 0; b < 6; b++){
+                ballPalette[(r * 7 + g) * 6 + b] = Color{(unsigned char)(r * 51), (unsigned char)(g * 255 / 6), (unsigned char)(b * 51), 255};
+            }
+        }
+    }
+}
+
+uint8_t quantizeColor(Color color){
+    int r = (color.r * 5 + 127) / 255;
+    int g = (color.g * 6 + 127) / 255;
+    int b = (color.b * 5 + 127) / 255;
+    return (uint8_t)((r * 7 + g) * 6 + b);
+}
+
+uint16_t quantizeRadius(float radius){
+    return (uint16_t)Clamp(radius * 256.0f + 0.5f, 0.0f, 65535.0f);
+}
+
+float dequantizeRadius(uint16_t radius){
+    return radius / 256.0f;
+}
+
 struct cell{
     Vector2 position = {0.0f, 0.0f};
     Color color = RED;
     Vector2 max;
     Vector2 min;
     
-    std::vector<Ball> ballsInCell;
+    std::vector<int> ballsInCell; // indices into ballArray
 
     bool operator==(const cell& cell){
         return (this->position.x == cell.position.x && this->position.y == cell.position.y);
@@ -60,13 +656,8 @@ struct cell{
     bool operator==(const Vector2& position){
         return (this->position.x == position.x && this->position.y == position.y);
     }
-    void addBall(Ball& ball){
-        if(std::find(ballsInCell.begin(), ballsInCell.end(), ball) != ballsInCell.end()){
-
-        }
-        else{
-            this->ballsInCell.push_back(ball);
-        }
+    void addBall(int index){
+        this->ballsInCell.push_back(index);
     }
     void clearBalls(){
         this->ballsInCell.clear();
@@ -100,285 +691,4073 @@ bool isCirclesColliding(Ball b1, Ball b2)
     return false;
 }
 
-Vector2 getNearestIndexAtPoint(Vector2 position){ // get the index of the cell (inverted)
-    if(position.x < 0){
-        return Vector2{0, std::floor(position.y/cellSize)};
+// The broadphase grid covering the world; cells must be at least the largest ball diameter.
+struct Grid
+{
+    std::vector<std::vector<cell>> rows;
+    float cellSize = DEFAULT_CELL_SIZE;
+    int columns = 0;
+
+    std::vector<cell> &operator[](int row){
+        return rows[row];
     }
-    if(position.y < 0){
-        return Vector2{std::floor(position.x/cellSize), 0};
+
+    const std::vector<cell> &operator[](int row) const {
+        return rows[row];
     }
-    if(position.x < 0 && position.y < 0){
-        return Vector2{0, 0};
+
+    int size() const {
+        return rows.size();
     }
 
-    if(position.x > WINDOW_WIDTH){
-        return Vector2{std::floor((float)WINDOW_WIDTH/cellSize), std::floor(position.y/cellSize)};
+    bool empty() const {
+        return rows.empty();
     }
-    if(position.y > WINDOW_HEIGHT){
-        return Vector2{std::floor(position.x/cellSize), std::floor((float)WINDOW_HEIGHT/cellSize)};
+
+    std::vector<std::vector<cell>>::iterator begin(){
+        return rows.begin();
     }
-    if(position.x > WINDOW_WIDTH && position.y > WINDOW_HEIGHT){
-        return Vector2{std::floor((float)WINDOW_WIDTH/cellSize), std::floor((float)WINDOW_HEIGHT/cellSize)};
+
+    std::vector<std::vector<cell>>::iterator end(){
+        return rows.end();
     }
-    return Vector2{std::floor(position.x/cellSize), std::floor(position.y/cellSize)};
+};
+
+Vector2 getNearestIndexAtPoint(const Grid &grid, Vector2 position){ // get the index of the cell (inverted), clamped to the grid
+    float lastColumn = grid.columns - 1;
+    float lastRow = grid.size() - 1;
+    return Vector2{Clamp(std::floor(position.x/grid.cellSize), 0, lastColumn), Clamp(std::floor(position.y/grid.cellSize), 0, lastRow)};
 }
 
-void initializeCell(cell &testCell, Vector2 pos, Color color){ 
+void initializeCell(cell &testCell, Vector2 pos, float cellSize, Color color){ 
     testCell.position = pos;
     testCell.max = Vector2{testCell.position.x + cellSize, testCell.position.y};
     testCell.min = Vector2{testCell.position.x, testCell.position.y + cellSize};
     testCell.color = color;
 }
 
-void initializeAllCells(std::vector<std::vector<cell>> &Cells){ 
-    // get array of columns, store it in a row.
-    int numberOFRows = std::ceil((float)WINDOW_HEIGHT/(float)cellSize);
-    int numberOfColumns = std::ceil((float)WINDOW_WIDTH/(float)cellSize);
-    std::cout << numberOFRows << std::endl;
-    std::cout << numberOfColumns << std::endl;
+// (Re)builds the grid over the world with empty cells; refill them with updateCellContents.
+void initializeAllCells(Grid &grid, float cellSize, Vector2 world){ 
+    int numberOFRows = std::max(1, (int)std::ceil(world.y/cellSize));
+    grid.columns = std::max(1, (int)std::ceil(world.x/cellSize));
+    grid.cellSize = cellSize;
+    grid.rows.assign(numberOFRows, std::vector<cell>(grid.columns));
     for (int i = 0; i < numberOFRows; i++){
-        std::vector<cell> row;
-        for (int j = 0; j < numberOfColumns; j++){
-            cell x;
-            initializeCell(x, Vector2{(float) j*cellSize, (float) i*cellSize}, RED);
-            row.push_back(x); 
+        for (int j = 0; j < grid.columns; j++){
+            initializeCell(grid[i][j], Vector2{(float) j*cellSize, (float) i*cellSize}, cellSize, RED);
         }
-        Cells.push_back(row);
     }
 } 
 
-void addBallToCell(std::vector<std::vector<cell>> &grid, Ball ball){
-    Vector2 max = Vector2{ball.position.x + ball.radius, ball.position.y + ball.radius};
-    Vector2 min = Vector2{ball.position.x - ball.radius, ball.position.y - ball.radius};
-
-    Vector2 indexAtMin = getNearestIndexAtPoint(min);
-    Vector2 indexAtCenter = getNearestIndexAtPoint(ball.position);
-    Vector2 indexAtMax = getNearestIndexAtPoint(max);
-    Vector2 indexAtLowerRight = getNearestIndexAtPoint(Vector2{max.x, min.y}); 
-    Vector2 indexAtUpperLeft = getNearestIndexAtPoint(Vector2{min.x, max.y}); 
-
+// Grows or shrinks the grid to a new world in place; true if it changed, in which case refill it.
+bool fitGridToWorld(Grid &grid, Vector2 world){
+    int rows = std::max(1, (int)std::ceil(world.y/grid.cellSize));
+    int columns = std::max(1, (int)std::ceil(world.x/grid.cellSize));
+    if(rows == grid.size() && columns == grid.columns){
+        return false;
+    }
+    grid.rows.resize(rows);
+    for (int i = 0; i < rows; i++){
+        int firstNew = grid[i].size();
+        grid[i].resize(columns);
+        for (int j = firstNew; j < columns; j++){
+            initializeCell(grid[i][j], Vector2{(float) j*grid.cellSize, (float) i*grid.cellSize}, grid.cellSize, RED);
+        }
+    }
+    grid.columns = columns;
+    return true;
+}
 
-    //std::cout << "Index At center" << indexAtCenter.x << " " << indexAtCenter.y << std::endl;
-    grid[indexAtCenter.y][indexAtCenter.x].addBall(ball);
+void addBallToCell(Grid &grid, const Ball &ball, int index){
+    // stored once, in the cell holding its center
+    Vector2 indexAtCenter = getNearestIndexAtPoint(grid, ball.position);
+    grid[indexAtCenter.y][indexAtCenter.x].addBall(index);
     grid[indexAtCenter.y][indexAtCenter.x].color = BLUE;
-
-    grid[indexAtMin.y][indexAtMin.x].addBall(ball);
-    grid[indexAtMin.y][indexAtMin.x].color = BLUE;
-
-    grid[indexAtMax.y][indexAtMax.x].addBall(ball);
-    grid[indexAtMax.y][indexAtMax.x].color = BLUE;
-
-    grid[indexAtLowerRight.y][indexAtLowerRight.x].addBall(ball);
-    grid[indexAtLowerRight.y][indexAtLowerRight.x].color = BLUE;
-
-    grid[indexAtUpperLeft.y][indexAtUpperLeft.x].addBall(ball);
-    grid[indexAtUpperLeft.y][indexAtUpperLeft.x].color = BLUE;
-    
 }
 
-void updateCellContents(std::vector<std::vector<cell>> &grid, std::vector<Ball> &balls){
+void updateCellContents(Grid &grid, std::vector<Ball> &balls){
     for(int i = 0; i < grid.size(); i++){
         for(int j = 0; j < grid[i].size(); j++){
             grid[i][j].clearBalls();
-            if(grid[i][j].ballsInCell.size() > 0){
-                grid[i][j].color = BLUE;
-            }
-            else{
-                grid[i][j].color = RED;
-            }
+            grid[i][j].color = RED;
         }
     }
     for(int k = 0; k < balls.size(); k++){
-        addBallToCell(grid, balls[k]);
+        addBallToCell(grid, balls[k], k);
     }
 }
 
-
-
-void checkCollisionInCell(std::vector<std::vector<cell>> &grid, float elasticityCoefficient, std::vector<Ball> &ballArray){
-    for(int i = 0; i < grid.size(); i++){
-        for(int j = 0; j < grid[i].size(); j++){
-            for(int k = 0; k < grid[i][j].ballsInCell.size(); k++){
-
-                ballArray[grid[i][j].ballsInCell[k].index].position = Vector2Add(grid[i][j].ballsInCell[k].position, Vector2Scale(grid[i][j].ballsInCell[k].velocity, TIMESTEP));
-
-                if (ballArray[grid[i][j].ballsInCell[k].index].position.x - ballArray[grid[i][j].ballsInCell[k].index].radius <= 0)
-                {
-                    ballArray[grid[i][j].ballsInCell[k].index].position.x = ballArray[grid[i][j].ballsInCell[k].index].radius;
-                    ballArray[grid[i][j].ballsInCell[k].index].velocity.x *= -1;
-                }
-                if(ballArray[grid[i][j].ballsInCell[k].index].position.x + ballArray[grid[i][j].ballsInCell[k].index].radius >= WINDOW_WIDTH)
-                {
-                    ballArray[grid[i][j].ballsInCell[k].index].position.x = WINDOW_WIDTH - ballArray[grid[i][j].ballsInCell[k].index].radius;
-                    ballArray[grid[i][j].ballsInCell[k].index].velocity.x *= -1;
-                }
-                if ( ballArray[grid[i][j].ballsInCell[k].index].position.y - ballArray[grid[i][j].ballsInCell[k].index].radius <= 0)
-                {
-                    ballArray[grid[i][j].ballsInCell[k].index].position.y = ballArray[grid[i][j].ballsInCell[k].index].radius;
-                    ballArray[grid[i][j].ballsInCell[k].index].velocity.y *= -1;
-                }
-                if(ballArray[grid[i][j].ballsInCell[k].index].position.y + ballArray[grid[i][j].ballsInCell[k].index].radius >= WINDOW_HEIGHT)
-                {
-                    ballArray[grid[i][j].ballsInCell[k].index].position.y = WINDOW_HEIGHT - ballArray[grid[i][j].ballsInCell[k].index].radius;
-                    ballArray[grid[i][j].ballsInCell[k].index].velocity.y *= -1;
-                }
-
-                for (int l = 0; l < grid[i][j].ballsInCell.size(); l++)
-                {
-                    if (l == k)
-                    {
-                        continue;
-                    }
-                    else if (l >= grid[i][j].ballsInCell.size() || k >= grid[i][j].ballsInCell.size())
-                    {
-                        break;
-                    }
-                    Vector2 n = Vector2Normalize(Vector2Subtract(ballArray[grid[i][j].ballsInCell[k].index].position, ballArray[grid[i][j].ballsInCell[l].index].position));
-                    if (isCirclesColliding(ballArray[grid[i][j].ballsInCell[k].index], ballArray[grid[i][j].ballsInCell[l].index]) && Vector2DotProduct(n, Vector2Subtract(grid[i][j].ballsInCell[k].velocity, grid[i][j].ballsInCell[l].velocity )) < 0)
-                    {
-                        float impulsej = -( ( 
-                        (1 + elasticityCoefficient) * Vector2DotProduct(Vector2Subtract(ballArray[grid[i][j].ballsInCell[k].index].velocity, ballArray[grid[i][j].ballsInCell[l].index].velocity ), n)) 
-                        / 
-                        (Vector2DotProduct(n, n) * (1 / ballArray[grid[i][j].ballsInCell[k].index].mass) + (1 / ballArray[grid[i][j].ballsInCell[l].index].mass)
-                        ));
-                        
-                        Vector2 newVelocity = Vector2Add(ballArray[grid[i][j].ballsInCell[k].index].velocity, Vector2Scale(n, (impulsej / ballArray[grid[i][j].ballsInCell[k].index].mass)));
-                        ballArray[grid[i][j].ballsInCell[k].index].velocity = newVelocity;
-                        Vector2 newVelocity2 = Vector2Subtract(ballArray[grid[i][j].ballsInCell[l].index].velocity, Vector2Scale(n, (impulsej / ballArray[grid[i][j].ballsInCell[l].index].mass)));
-                        ballArray[grid[i][j].ballsInCell[l].index].velocity = newVelocity2;
-
-                    }
+// Spatial queries over the broadphase grid. Results come out in cell order.
+void queryRadius(const Grid &grid, const std::vector<Ball> &ballArray, Vector2 center, float radius, std::vector<int> &result){
+    result.clear();
+    if(grid.empty()){
+        return;
+    }
+    Vector2 indexAtMin = getNearestIndexAtPoint(grid, Vector2{center.x - radius - MAX_BALL_RADIUS, center.y - radius - MAX_BALL_RADIUS});
+    Vector2 indexAtMax = getNearestIndexAtPoint(grid, Vector2{center.x + radius + MAX_BALL_RADIUS, center.y + radius + MAX_BALL_RADIUS});
+    for(int i = indexAtMin.y; i <= indexAtMax.y; i++){
+        for(int j = indexAtMin.x; j <= indexAtMax.x; j++){
+            for(int k : grid[i][j].ballsInCell){
+                float reach = radius + ballArray[k].radius;
+                if(Vector2DistanceSqr(ballArray[k].position, center) <= reach * reach){
+                    result.push_back(k);
                 }
             }
         }
     }
 }
 
-float RandomDirection()
-{
-    float x = static_cast<float>(rand()) / static_cast<float>(RAND_MAX);
-
-    // Make it [-1, 1]
-    return x * 2.0f - 1.0f;
+void queryRectangle(const Grid &grid, const std::vector<Ball> &ballArray, Rectangle area, std::vector<int> &result){
+    result.clear();
+    if(grid.empty()){
+        return;
+    }
+    Vector2 indexAtMin = getNearestIndexAtPoint(grid, Vector2{area.x - MAX_BALL_RADIUS, area.y - MAX_BALL_RADIUS});
+    Vector2 indexAtMax = getNearestIndexAtPoint(grid, Vector2{area.x + area.width + MAX_BALL_RADIUS, area.y + area.height + MAX_BALL_RADIUS});
+    for(int i = indexAtMin.y; i <= indexAtMax.y; i++){
+        for(int j = indexAtMin.x; j <= indexAtMax.x; j++){
+            for(int k : grid[i][j].ballsInCell){
+                const Ball &ball = ballArray[k];
+                Vector2 closest = Vector2{Clamp(ball.position.x, area.x, area.x + area.width), Clamp(ball.position.y, area.y, area.y + area.height)};
+                if(Vector2DistanceSqr(ball.position, closest) <= ball.radius * ball.radius){
+                    result.push_back(k);
+                }
+            }
+        }
+    }
 }
 
-void InitializeBall(std::vector<Ball> &array, int arraySize, bool isLarge)
-{
-    for (size_t i = 0; i < arraySize; i++)
-    {
-        Ball ball;
-        Color randomColor = {
-            GetRandomValue(0, 255),
-            GetRandomValue(0, 255),
-            GetRandomValue(0, 255),
-            255};
-        ball.position = {WINDOW_WIDTH / 2, WINDOW_HEIGHT / 2};
-        if (isLarge)
-        {
-            ball.radius = 25.0f;
-            ball.mass = 10.0f;
-            ball.inverse_mass = 1.0f / 10.0f;
+// The count nearest balls to point by center distance, closest first, searching rings of cells outwards.
+void queryNearest(const Grid &grid, const std::vector<Ball> &ballArray, Vector2 point, int count, std::vector<int> &result){
+    result.clear();
+    if(grid.empty() || count <= 0){
+        return;
+    }
+    int rows = grid.size();
+    int columns = grid[0].size();
+    Vector2 origin = getNearestIndexAtPoint(grid, point);
+    std::vector<std::pair<float, int>> candidates;
+    int lastRing = std::max(std::max((int)origin.x, columns - 1 - (int)origin.x), std::max((int)origin.y, rows - 1 - (int)origin.y));
+    for(int ring = 0; ring <= lastRing; ring++){
+        for(int i = std::max(0, (int)origin.y - ring); i <= std::min(rows - 1, (int)origin.y + ring); i++){
+            bool edgeRow = i == (int)origin.y - ring || i == (int)origin.y + ring;
+            int columnStep = edgeRow ? 1 : 2 * ring;
+            for(int j = (int)origin.x - ring; j <= (int)origin.x + ring; j += std::max(1, columnStep)){
+                if(j < 0 || j >= columns){
+                    continue;
+                }
+                for(int k : grid[i][j].ballsInCell){
+                    candidates.push_back(std::make_pair(Vector2DistanceSqr(ballArray[k].position, point), k));
+                }
+            }
         }
-        else
-        {
-            ball.radius = (float)GetRandomValue(5, 10);
-            ball.mass = 1.0f;
-            ball.inverse_mass = 1.0f;
+        // everything outside this ring is at least ring cells away from the point
+        if(candidates.size() >= count){
+            std::nth_element(candidates.begin(), candidates.begin() + (count - 1), candidates.end());
+            float bound = (float)(ring * grid.cellSize);
+            if(candidates[count - 1].first <= bound * bound){
+                break;
+            }
         }
-        ball.color = randomColor;
-        ball.velocity = {500.0f * RandomDirection(), 500.0f * RandomDirection()};
-        array.push_back(ball);
+    }
+    int found = std::min(count, (int)candidates.size());
+    std::partial_sort(candidates.begin(), candidates.begin() + found, candidates.end());
+    for(int n = 0; n < found; n++){
+        result.push_back(candidates[n].second);
     }
 }
 
-void updateBallsIndex(std::vector<Ball> &ballArray){
-    for(int i = 0; i < ballArray.size(); i++){
-        ballArray[i].index = i;
+struct RaycastHit
+{
+    int ball = -1;
+    float distance = 0.0f;
+    Vector2 point = {0.0f, 0.0f};
+    Vector2 normal = {0.0f, 0.0f};
+};
+
+// Returns the distance along the unit direction to where the ray enters the ball, 0 if it starts inside, or -1.
+float rayCircleIntersection(Vector2 origin, Vector2 direction, Vector2 center, float radius){
+    Vector2 offset = Vector2Subtract(origin, center);
+    float b = Vector2DotProduct(offset, direction);
+    float c = Vector2LengthSqr(offset) - radius * radius;
+    if(c <= 0.0f){
+        return 0.0f;
     }
+    float discriminant = b * b - c;
+    if(b > 0.0f || discriminant < 0.0f){
+        return -1.0f;
+    }
+    return -b - std::sqrt(discriminant);
 }
 
-Vector2 getCenterOfRectangle(Vector2 RectanglePos, float width, float height){ // ( (x1 + x2) / 2, (y1 + y2) / 2 )
+// First ball the ray touches within maxDistance, walking the cells under the ray in order.
+bool raycastBalls(const Grid &grid, const std::vector<Ball> &ballArray, Vector2 origin, Vector2 direction, float maxDistance, RaycastHit &hit){
+    hit = RaycastHit{};
+    direction = Vector2Normalize(direction);
+    if(grid.empty() || (direction.x == 0.0f && direction.y == 0.0f)){
+        return false;
+    }
+    int rows = grid.size();
+    int columns = grid[0].size();
+    // clip to the grid plus a one-cell margin, which the walk treats as part of the edge cells
+    float start = 0.0f;
+    float end = maxDistance;
+    float size[2] = {(float)(columns * grid.cellSize), (float)(rows * grid.cellSize)};
+    float from[2] = {origin.x, origin.y};
+    float along[2] = {direction.x, direction.y};
+    for(int axis = 0; axis < 2; axis++){
+        if(along[axis] == 0.0f){
+            if(from[axis] < -grid.cellSize || from[axis] > size[axis] + grid.cellSize){
+                return false;
+            }
+            continue;
+        }
+        float t1 = (-grid.cellSize - from[axis]) / along[axis];
+        float t2 = (size[axis] + grid.cellSize - from[axis]) / along[axis];
+        start = std::max(start, std::min(t1, t2));
+        end = std::min(end, std::max(t1, t2));
+    }
+    if(start > end){
+        return false;
+    }
+
+    Vector2 entry = Vector2Add(origin, Vector2Scale(direction, start));
+    Vector2 index = getNearestIndexAtPoint(grid, entry);
+    int column = index.x;
+    int row = index.y;
+    int stepX = direction.x > 0.0f ? 1 : -1;
+    int stepY = direction.y > 0.0f ? 1 : -1;
+    float nextX = direction.x != 0.0f ? ((column + (stepX > 0 ? 1 : 0)) * grid.cellSize - origin.x) / direction.x : INFINITY;
+    float nextY = direction.y != 0.0f ? ((row + (stepY > 0 ? 1 : 0)) * grid.cellSize - origin.y) / direction.y : INFINITY;
+    float deltaX = direction.x != 0.0f ? grid.cellSize / std::abs(direction.x) : INFINITY;
+    float deltaY = direction.y != 0.0f ? grid.cellSize / std::abs(direction.y) : INFINITY;
+    // an edge cell reaches one cell further out, over the margin
+    int lastColumn = stepX > 0 ? columns - 1 : 0;
+    int lastRow = stepY > 0 ? rows - 1 : 0;
+    if(column == lastColumn){
+        nextX += deltaX;
+    }
+    if(row == lastRow){
+        nextY += deltaY;
+    }
+
+    hit.distance = maxDistance;
+    while(true){
+        // a ball reaching into this cell is filed at most one cell away, since none is wider than a cell
+        for(int i = std::max(0, row - 1); i <= std::min(rows - 1, row + 1); i++){
+            for(int j = std::max(0, column - 1); j <= std::min(columns - 1, column + 1); j++){
+                for(int k : grid[i][j].ballsInCell){
+                    float t = rayCircleIntersection(origin, direction, ballArray[k].position, ballArray[k].radius);
+                    if(t >= 0.0f && t <= maxDistance && (hit.ball < 0 || t < hit.distance)){
+                        hit.ball = k;
+                        hit.distance = t;
+                    }
+                }
+            }
+        }
+        float cellExit = std::min(nextX, nextY);
+        if((hit.ball >= 0 && hit.distance <= cellExit) || cellExit > end){
+            break;
+        }
+        if(nextX < nextY){
+            column += stepX;
+            nextX += column == lastColumn ? 2.0f * deltaX : deltaX;
+        }
+        else{
+            row += stepY;
+            nextY += row == lastRow ? 2.0f * deltaY : deltaY;
+        }
+        if(column < 0 || column >= columns || row < 0 || row >= rows){
+            break;
+        }
+    }
+    if(hit.ball < 0){
+        return false;
+    }
+    hit.point = Vector2Add(origin, Vector2Scale(direction, hit.distance));
+    hit.normal = Vector2Normalize(Vector2Subtract(hit.point, ballArray[hit.ball].position));
+    return true;
+}
+
+// A sleeping ball acts as static until something hits it hard enough to wake it.
+void pinOrWakeSleeper(std::vector<Ball> &ballArray, int a, int b, float approachSpeed, const SimulationSettings &settings, SleepIslands &islands, float &inverseMass1, float &inverseMass2){
+    bool asleep1 = isAsleep(ballArray[a], settings);
+    bool asleep2 = isAsleep(ballArray[b], settings);
+    if(asleep1 || asleep2){
+        int sleeper = asleep1 ? a : b;
+        if(approachSpeed > settings.wakeVelocity){
+            islands.wokenIslands.push_back(findIsland(islands, sleeper));
+            islands.parent[sleeper] = sleeper;
+            ballArray[sleeper].sleepCounter = 0;
+        }
+        else if(asleep1){
+            inverseMass1 = 0.0f;
+        }
+        else{
+            inverseMass2 = 0.0f;
+        }
+    }
+    if(settings.sleepEnabled){
+        joinIslands(islands, a, b);
+    }
+}
+
+// Returns the impulse applied, zero if the balls were already separating.
+float applyContactImpulse(Ball &b1, Ball &b2, Vector2 n, float approachSpeed, float inverseMass1, float inverseMass2, const SimulationSettings &settings){
+    if (approachSpeed > 0)
+    {
+        float elasticityCoefficient = approachSpeed < settings.restitutionThreshold ? 0.0f : settings.elasticityCoefficient;
+        float impulsej = ((1 + elasticityCoefficient) * approachSpeed) / (inverseMass1 + inverseMass2);
+
+        b1.velocity = Vector2Add(b1.velocity, Vector2Scale(n, impulsej * inverseMass1));
+        b2.velocity = Vector2Subtract(b2.velocity, Vector2Scale(n, impulsej * inverseMass2));
+        return impulsej;
+    }
+    return 0.0f;
+}
+
+void collideBalls(std::vector<Ball> &ballArray, int a, int b, const SimulationSettings &settings, SleepIslands &islands, CollisionEventRing *events){
+    Ball &b1 = ballArray[a];
+    Ball &b2 = ballArray[b];
+    bool asleep1 = isAsleep(b1, settings);
+    bool asleep2 = isAsleep(b2, settings);
+    if(asleep1 && asleep2){
+        return;
+    }
+    if (!isCirclesColliding(b1, b2))
+    {
+        return;
+    }
+    Vector2 n = Vector2Normalize(Vector2Subtract(b1.position, b2.position));
+    float approachSpeed = -Vector2DotProduct(n, Vector2Subtract(b1.velocity, b2.velocity));
+
+    float inverseMass1 = b1.inverse_mass;
+    float inverseMass2 = b2.inverse_mass;
+    pinOrWakeSleeper(ballArray, a, b, approachSpeed, settings, islands, inverseMass1, inverseMass2);
+
+    if(settings.positionCorrection > 0.0f){
+        float overlap = b1.radius + b2.radius - getDistance(b1, b2) - 0.5f;
+        if(overlap > 0.0f){
+            Vector2 correction = Vector2Scale(n, overlap * settings.positionCorrection / (inverseMass1 + inverseMass2));
+            b1.position = Vector2Add(b1.position, Vector2Scale(correction, inverseMass1));
+            b2.position = Vector2Subtract(b2.position, Vector2Scale(correction, inverseMass2));
+        }
+    }
+
+    float impulse = applyContactImpulse(b1, b2, n, approachSpeed, inverseMass1, inverseMass2, settings);
+    emitCollisionEvent(events, a, b, Vector2Add(b2.position, Vector2Scale(n, b2.radius)), n, impulse);
+}
+
+float bounceVelocity(float velocity, const SimulationSettings &settings){
+    if(std::abs(velocity) < settings.restitutionThreshold){
+        return 0.0f;
+    }
+    return -velocity * settings.elasticityCoefficient;
+}
+
+void collideWalls(Ball &ball, const SimulationSettings &settings){
+    if (ball.position.x - ball.radius <= 0)
+    {
+        ball.position.x = ball.radius;
+        if(ball.velocity.x < 0){
+            ball.velocity.x = bounceVelocity(ball.velocity.x, settings);
+        }
+    }
+    if (ball.position.x + ball.radius >= settings.world.x)
+    {
+        ball.position.x = settings.world.x - ball.radius;
+        if(ball.velocity.x > 0){
+            ball.velocity.x = bounceVelocity(ball.velocity.x, settings);
+        }
+    }
+    if (ball.position.y - ball.radius <= 0)
+    {
+        ball.position.y = ball.radius;
+        if(ball.velocity.y < 0){
+            ball.velocity.y = bounceVelocity(ball.velocity.y, settings);
+        }
+    }
+    if (ball.position.y + ball.radius >= settings.world.y)
+    {
+        ball.position.y = settings.world.y - ball.radius;
+        if(ball.velocity.y > 0){
+            ball.velocity.y = bounceVelocity(ball.velocity.y, settings);
+        }
+    }
+}
+
+// Like collideWalls for the level geometry. from is where the ball was before it last moved.
+void collideObstacles(Ball &ball, Vector2 from, const StaticGeometry &obstacles, const SimulationSettings &settings){
+    Vector2 reach = {ball.radius, ball.radius};
+    forEachObstacleNear(obstacles, Vector2Subtract(componentMin(from, ball.position), reach), Vector2Add(componentMax(from, ball.position), reach), [&](int o){
+        Vector2 n;
+        float depth;
+        if(!obstacleContact(obstacles, o, ball.position, ball.radius, from, n, depth)){
+            return;
+        }
+        ball.position = Vector2Add(ball.position, Vector2Scale(n, depth));
+        float normalSpeed = Vector2DotProduct(ball.velocity, n);
+        if(normalSpeed < 0.0f){
+            ball.velocity = Vector2Add(ball.velocity, Vector2Scale(n, bounceVelocity(normalSpeed, settings) - normalSpeed));
+        }
+    });
+}
+
+// Fraction of the displacement at which two moving circles first touch, or -1 (also if they already overlap).
+float sweptCircleTimeOfImpact(Vector2 relativePosition, Vector2 relativeDisplacement, float sumOfRadii){
+    float a = Vector2DotProduct(relativeDisplacement, relativeDisplacement);
+    float b = 2.0f * Vector2DotProduct(relativePosition, relativeDisplacement);
+    float c = Vector2DotProduct(relativePosition, relativePosition) - sumOfRadii * sumOfRadii;
+    if(c <= 0.0f || a <= 0.0f || b >= 0.0f){
+        return -1.0f;
+    }
+    float discriminant = b * b - 4.0f * a * c;
+    if(discriminant < 0.0f){
+        return -1.0f;
+    }
+    float t = (-b - std::sqrt(discriminant)) / (2.0f * a);
+    return t <= 1.0f ? t : -1.0f;
+}
+
+// Fraction of the displacement at which the ball reaches a wall, or -1.
+float wallTimeOfImpact(float position, float displacement, float radius, float size){
+    if(displacement < 0.0f && position - radius > 0.0f){
+        float t = (radius - position) / displacement;
+        return t <= 1.0f ? t : -1.0f;
+    }
+    if(displacement > 0.0f && position + radius < size){
+        float t = (size - radius - position) / displacement;
+        return t <= 1.0f ? t : -1.0f;
+    }
+    return -1.0f;
+}
+
+// Moves a fast ball through its step in pieces, stopping at each ball or wall it would pass through.
+void sweepFastBall(Grid &grid, std::vector<Ball> &ballArray, int k, const SimulationSettings &settings, SleepIslands &islands, CollisionEventRing *events){
+    Ball &ball = ballArray[k];
+    float reach = ball.radius + MAX_BALL_RADIUS;
+
+    float elapsed = 0.0f;
+    for(int iteration = 0; iteration < 4 && elapsed < TIMESTEP; iteration++){
+        float remaining = TIMESTEP - elapsed;
+        Vector2 displacement = Vector2Scale(ball.velocity, remaining);
+        float hitTime = 1.0f;
+        int hitBall = -1;
+        int hitAxis = -1;
+
+        // only the cells within reach of the remaining path, row by row
+        Vector2 end = Vector2Add(ball.position, displacement);
+        int rowMin = getNearestIndexAtPoint(grid, Vector2{0.0f, std::min(ball.position.y, end.y) - reach}).y;
+        int rowMax = getNearestIndexAtPoint(grid, Vector2{0.0f, std::max(ball.position.y, end.y) + reach}).y;
+        for(int i = rowMin; i <= rowMax; i++){
+            float enter = 0.0f;
+            float leave = 1.0f;
+            if(displacement.y != 0.0f){
+                float top = (i * grid.cellSize - reach - ball.position.y) / displacement.y;
+                float bottom = ((i + 1) * grid.cellSize + reach - ball.position.y) / displacement.y;
+                enter = std::max(enter, std::min(top, bottom));
+                leave = std::min(leave, std::max(top, bottom));
+            }
+            float x1 = ball.position.x + displacement.x * enter;
+            float x2 = ball.position.x + displacement.x * leave;
+            int columnMin = getNearestIndexAtPoint(grid, Vector2{std::min(x1, x2) - reach, 0.0f}).x;
+            int columnMax = getNearestIndexAtPoint(grid, Vector2{std::max(x1, x2) + reach, 0.0f}).x;
+            for(int j = columnMin; j <= columnMax; j++){
+                for(int l : grid[i][j].ballsInCell){
+                    if(l == k || l >= ballArray.size()){
+                        continue;
+                    }
+                    Ball &other = ballArray[l];
+                    Vector2 otherVelocity = isAsleep(other, settings) ? Vector2Zero() : other.velocity;
+                    // balls before k have already moved this step
+                    Vector2 otherPosition = l < k ? Vector2Subtract(other.position, Vector2Scale(otherVelocity, remaining))
+                                                  : Vector2Add(other.position, Vector2Scale(otherVelocity, elapsed));
+                    float t = sweptCircleTimeOfImpact(Vector2Subtract(ball.position, otherPosition),
+                                                      Vector2Subtract(displacement, Vector2Scale(otherVelocity, remaining)),
+                                                      ball.radius + other.radius);
+                    if(t >= 0.0f && t < hitTime){
+                        hitTime = t;
+                        hitBall = l;
+                    }
+                }
+            }
+        }
+        float t = wallTimeOfImpact(ball.position.x, displacement.x, ball.radius, settings.world.x);
+        if(t >= 0.0f && t < hitTime){
+            hitTime = t;
+            hitBall = -1;
+            hitAxis = 0;
+        }
+        t = wallTimeOfImpact(ball.position.y, displacement.y, ball.radius, settings.world.y);
+        if(t >= 0.0f && t < hitTime){
+            hitTime = t;
+            hitBall = -1;
+            hitAxis = 1;
+        }
+
+        ball.position = Vector2Add(ball.position, Vector2Scale(displacement, hitTime));
+        elapsed += remaining * hitTime;
+
+        if(hitBall >= 0){
+            Ball &other = ballArray[hitBall];
+            Vector2 otherVelocity = isAsleep(other, settings) ? Vector2Zero() : other.velocity;
+            Vector2 otherPosition = hitBall < k ? Vector2Subtract(other.position, Vector2Scale(otherVelocity, TIMESTEP - elapsed))
+                                                : Vector2Add(other.position, Vector2Scale(otherVelocity, elapsed));
+            Vector2 n = Vector2Normalize(Vector2Subtract(ball.position, otherPosition));
+            float approachSpeed = -Vector2DotProduct(n, Vector2Subtract(ball.velocity, otherVelocity));
+
+            float inverseMass1 = ball.inverse_mass;
+            float inverseMass2 = other.inverse_mass;
+            pinOrWakeSleeper(ballArray, k, hitBall, approachSpeed, settings, islands, inverseMass1, inverseMass2);
+            Vector2 velocityBefore = other.velocity;
+            float impulse = applyContactImpulse(ball, other, n, approachSpeed, inverseMass1, inverseMass2, settings);
+            emitCollisionEvent(events, k, hitBall, Vector2Subtract(ball.position, Vector2Scale(n, ball.radius)), n, impulse);
+            Vector2 velocityChange = Vector2Subtract(other.velocity, velocityBefore);
+            if(hitBall < k){
+                other.position = Vector2Add(other.position, Vector2Scale(velocityChange, TIMESTEP - elapsed));
+            }
+            else{
+                other.position = Vector2Subtract(other.position, Vector2Scale(velocityChange, elapsed));
+            }
+        }
+        else if(hitAxis == 0){
+            ball.velocity.x = bounceVelocity(ball.velocity.x, settings);
+        }
+        else if(hitAxis == 1){
+            ball.velocity.y = bounceVelocity(ball.velocity.y, settings);
+        }
+        else{
+            break;
+        }
+    }
+    if(elapsed < TIMESTEP){
+        ball.position = Vector2Add(ball.position, Vector2Scale(ball.velocity, TIMESTEP - elapsed));
+    }
+    collideWalls(ball, settings);
+}
+
+void integrateBalls(Grid &grid, std::vector<Ball> &ballArray, const SimulationSettings &settings, PhysicsState &physics){
+    float damping = std::max(0.0f, 1.0f - settings.linearDamping * TIMESTEP);
+    if(!physics.obstacles.obstacles.empty()){
+        physics.previousPositions.resize(ballArray.size());
+        for(int k = 0; k < ballArray.size(); k++){
+            physics.previousPositions[k] = ballArray[k].position;
+        }
+    }
+    for(int k = 0; k < ballArray.size(); k++){
+        Ball &ball = ballArray[k];
+        if(isAsleep(ball, settings)){
+            continue;
+        }
+        if(settings.gravityEnabled){
+            ball.velocity = Vector2Scale(Vector2Add(ball.velocity, Vector2Scale(settings.gravity, TIMESTEP)), damping);
+        }
+        if(!physics.forces.empty()){
+            ball.velocity = Vector2Add(ball.velocity, Vector2Scale(physics.forces[k], ball.inverse_mass * TIMESTEP));
+        }
+        if(settings.maxSpeed > 0.0f){
+            ball.velocity = Vector2ClampValue(ball.velocity, 0.0f, settings.maxSpeed);
+        }
+        if(settings.continuousCollision && Vector2Length(ball.velocity) * TIMESTEP > settings.continuousCollisionThreshold * ball.radius){
+            sweepFastBall(grid, ballArray, k, settings, physics.islands, physics.events.get());
+            continue;
+        }
+        ball.position = Vector2Add(ball.position, Vector2Scale(ball.velocity, TIMESTEP));
+
+        collideWalls(ball, settings);
+    }
+
+    // after every ball has moved, since a swept ball also shifts the balls it hits
+    if(!physics.obstacles.obstacles.empty()){
+        for(int k = 0; k < ballArray.size(); k++){
+            if(!isAsleep(ballArray[k], settings)){
+                collideObstacles(ballArray[k], physics.previousPositions[k], physics.obstacles, settings);
+            }
+        }
+    }
+}
+
+void updateSleep(std::vector<Ball> &ballArray, const SimulationSettings &settings, SleepIslands &islands){
+    int count = ballArray.size();
+    std::vector<int> &islandRestSteps = islands.scratch;
+
+    // wake every island that was hit hard enough this step
+    if(!islands.wokenIslands.empty()){
+        islandRestSteps.assign(count, 0);
+        for(int root : islands.wokenIslands){
+            islandRestSteps[root] = 1;
+        }
+        for(int i = 0; i < count; i++){
+            if(isAsleep(ballArray[i], settings) && islandRestSteps[findIsland(islands, i)] == 1){
+                ballArray[i].sleepCounter = 0;
+            }
+        }
+        islands.wokenIslands.clear();
+    }
+
+    // an island falls asleep once every ball in it has been slow for sleepSteps
+    float sleepVelocitySq = settings.sleepVelocity * settings.sleepVelocity;
+    islandRestSteps.assign(count, settings.sleepSteps);
+    for(int i = 0; i < count; i++){
+        Ball &ball = ballArray[i];
+        if(isAsleep(ball, settings)){
+            continue;
+        }
+        int restSteps = Vector2LengthSqr(ball.velocity) < sleepVelocitySq ? ball.sleepCounter + 1 : 0;
+        ball.sleepCounter = std::min(restSteps, settings.sleepSteps - 1);
+        int root = findIsland(islands, i);
+        islandRestSteps[root] = std::min(islandRestSteps[root], restSteps);
+    }
+    for(int i = 0; i < count; i++){
+        Ball &ball = ballArray[i];
+        if(isAsleep(ball, settings)){
+            continue;
+        }
+        int root = findIsland(islands, i);
+        if(islandRestSteps[root] >= settings.sleepSteps){
+            ball.sleepCounter = settings.sleepSteps;
+            ball.velocity = Vector2Zero();
+            islands.parent[i] = root;
+        }
+    }
+}
+
+// Calls pairFunction(a, b) once for every pair of balls in the same or neighbouring cells.
+template <typename PairFunction>
+void forEachNearbyPair(Grid &grid, PairFunction pairFunction){
+    const int neighbourOffsets[4][2] = {{0, 1}, {1, -1}, {1, 0}, {1, 1}};
+    for(int i = 0; i < grid.size(); i++){
+        for(int j = 0; j < grid[i].size(); j++){
+            std::vector<int> &balls = grid[i][j].ballsInCell;
+            for(int k = 0; k < balls.size(); k++){
+                for (int l = k + 1; l < balls.size(); l++)
+                {
+                    pairFunction(balls[k], balls[l]);
+                }
+                for(int o = 0; o < 4; o++){
+                    int ni = i + neighbourOffsets[o][0];
+                    int nj = j + neighbourOffsets[o][1];
+                    if(ni < 0 || ni >= grid.size() || nj < 0 || nj >= grid[ni].size()){
+                        continue;
+                    }
+                    std::vector<int> &neighbours = grid[ni][nj].ballsInCell;
+                    for (int l = 0; l < neighbours.size(); l++)
+                    {
+                        pairFunction(balls[k], neighbours[l]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void addContact(PhysicsState &physics, const std::vector<Ball> &ballArray, int a, int b, Vector2 n, float overlap, float inverseMass1, float inverseMass2, const SimulationSettings &settings){
+    if(inverseMass1 + inverseMass2 <= 0.0f){
+        return;
+    }
+    Contact contact;
+    contact.a = a;
+    contact.b = b;
+    contact.normal = n;
+    contact.inverseMass1 = inverseMass1;
+    contact.inverseMass2 = inverseMass2;
+    contact.normalMass = 1.0f / (inverseMass1 + inverseMass2);
+
+    // a gap that closes within the step is solved as touching
+    Vector2 relativeVelocity = b >= 0 ? Vector2Subtract(ballArray[a].velocity, ballArray[b].velocity) : ballArray[a].velocity;
+    float approachSpeed = -Vector2DotProduct(relativeVelocity, n);
+    contact.bounceSpeed = 0.0f;
+    if(overlap < 0.0f && approachSpeed * TIMESTEP <= -overlap){
+        contact.bias = overlap / TIMESTEP;
+    }
+    else{
+        contact.bias = settings.positionCorrection / TIMESTEP * std::max(overlap - 0.5f, 0.0f);
+        if(approachSpeed > settings.restitutionThreshold){
+            contact.bounceSpeed = settings.elasticityCoefficient * approachSpeed;
+        }
+    }
+
+    contact.impulse = 0.0f;
+    if(settings.warmStarting){
+        std::unordered_map<uint64_t, float>::iterator cached = physics.contactCache.find(contactKey(a, b));
+        if(cached != physics.contactCache.end()){
+            contact.impulse = cached->second;
+        }
+    }
+    physics.contacts.push_back(contact);
+}
+
+void findContacts(Grid &grid, std::vector<Ball> &ballArray, const SimulationSettings &settings, PhysicsState &physics){
+    physics.contacts.clear();
+    forEachNearbyPair(grid, [&](int a, int b){
+        if(a > b){
+            std::swap(a, b);
+        }
+        Ball &b1 = ballArray[a];
+        Ball &b2 = ballArray[b];
+        float reach = b1.radius + b2.radius + CONTACT_MARGIN;
+        if((isAsleep(b1, settings) && isAsleep(b2, settings)) || Vector2DistanceSqr(b1.position, b2.position) > reach * reach){
+            return;
+        }
+        Vector2 n = Vector2Normalize(Vector2Subtract(b1.position, b2.position));
+        float approachSpeed = -Vector2DotProduct(n, Vector2Subtract(b1.velocity, b2.velocity));
+        float inverseMass1 = b1.inverse_mass;
+        float inverseMass2 = b2.inverse_mass;
+        pinOrWakeSleeper(ballArray, a, b, approachSpeed, settings, physics.islands, inverseMass1, inverseMass2);
+        addContact(physics, ballArray, a, b, n, b1.radius + b2.radius - getDistance(b1, b2), inverseMass1, inverseMass2, settings);
+    });
+
+    // walls are static contacts so stacks resting on them converge too
+    for(int k = 0; k < ballArray.size(); k++){
+        Ball &ball = ballArray[k];
+        if(isAsleep(ball, settings)){
+            continue;
+        }
+        const float margin = CONTACT_MARGIN;
+        if(ball.position.x - ball.radius <= margin){
+            addContact(physics, ballArray, k, -1, Vector2{1, 0}, ball.radius - ball.position.x, ball.inverse_mass, 0.0f, settings);
+        }
+        if(ball.position.x + ball.radius >= settings.world.x - margin){
+            addContact(physics, ballArray, k, -2, Vector2{-1, 0}, ball.position.x + ball.radius - settings.world.x, ball.inverse_mass, 0.0f, settings);
+        }
+        if(ball.position.y - ball.radius <= margin){
+            addContact(physics, ballArray, k, -3, Vector2{0, 1}, ball.radius - ball.position.y, ball.inverse_mass, 0.0f, settings);
+        }
+        if(ball.position.y + ball.radius >= settings.world.y - margin){
+            addContact(physics, ballArray, k, -4, Vector2{0, -1}, ball.position.y + ball.radius - settings.world.y, ball.inverse_mass, 0.0f, settings);
+        }
+        // obstacle ids follow the four walls
+        Vector2 reach = {ball.radius + margin, ball.radius + margin};
+        forEachObstacleNear(physics.obstacles, Vector2Subtract(ball.position, reach), Vector2Add(ball.position, reach), [&](int o){
+            Vector2 n;
+            float depth;
+            if(obstacleContact(physics.obstacles, o, ball.position, ball.radius + margin, ball.position, n, depth)){
+                addContact(physics, ballArray, k, -5 - o, n, depth - margin, ball.inverse_mass, 0.0f, settings);
+            }
+        });
+    }
+}
+
+void applyImpulse(std::vector<Ball> &ballArray, const Contact &contact, float impulse){
+    Ball &b1 = ballArray[contact.a];
+    b1.velocity = Vector2Add(b1.velocity, Vector2Scale(contact.normal, impulse * contact.inverseMass1));
+    if(contact.b >= 0){
+        Ball &b2 = ballArray[contact.b];
+        b2.velocity = Vector2Subtract(b2.velocity, Vector2Scale(contact.normal, impulse * contact.inverseMass2));
+    }
+}
+
+// Sequential impulses, warm-started from last step's accumulated impulses.
+void solveContacts(std::vector<Ball> &ballArray, const SimulationSettings &settings, PhysicsState &physics){
+    std::vector<Contact> &contacts = physics.contacts;
+    for(int c = 0; c < contacts.size(); c++){
+        if(contacts[c].impulse != 0.0f){
+            applyImpulse(ballArray, contacts[c], contacts[c].impulse);
+        }
+    }
+
+    for(int iteration = 0; iteration < settings.solverIterations; iteration++){
+        for(int c = 0; c < contacts.size(); c++){
+            Contact &contact = contacts[c];
+            Vector2 relativeVelocity = contact.b >= 0 ? Vector2Subtract(ballArray[contact.a].velocity, ballArray[contact.b].velocity) : ballArray[contact.a].velocity;
+            float separatingSpeed = Vector2DotProduct(relativeVelocity, contact.normal);
+            float impulse = std::max(contact.impulse + contact.normalMass * (contact.bias - separatingSpeed), 0.0f);
+            float change = impulse - contact.impulse;
+            contact.impulse = impulse;
+            applyImpulse(ballArray, contact, change);
+        }
+    }
+
+    // restitution is applied once the contacts agree, so bounces in a cluster cannot feed on each other
+    for(int c = 0; c < contacts.size(); c++){
+        Contact &contact = contacts[c];
+        float impulse = contact.impulse;
+        if(contact.bounceSpeed > 0.0f && contact.impulse > 0.0f){
+            Vector2 relativeVelocity = contact.b >= 0 ? Vector2Subtract(ballArray[contact.a].velocity, ballArray[contact.b].velocity) : ballArray[contact.a].velocity;
+            float separatingSpeed = Vector2DotProduct(relativeVelocity, contact.normal);
+            impulse = std::max(contact.impulse + contact.normalMass * (contact.bounceSpeed - separatingSpeed), 0.0f);
+            applyImpulse(ballArray, contact, impulse - contact.impulse);
+        }
+        if(contact.b >= 0){
+            const Ball &b2 = ballArray[contact.b];
+            emitCollisionEvent(physics.events.get(), contact.a, contact.b, Vector2Add(b2.position, Vector2Scale(contact.normal, b2.radius)), contact.normal, impulse);
+        }
+    }
+
+    physics.contactCache.clear();
+    for(int c = 0; c < contacts.size(); c++){
+        physics.contactCache[contactKey(contacts[c].a, contacts[c].b)] = contacts[c].impulse;
+    }
+}
+
+// Pairs that can touch at any point of the step, found once through the grid and reused by every substep.
+void findCandidatePairs(Grid &grid, std::vector<Ball> &ballArray, const SimulationSettings &settings, PhysicsState &physics){
+    physics.contacts.clear();
+    forEachNearbyPair(grid, [&](int a, int b){
+        Ball &b1 = ballArray[a];
+        Ball &b2 = ballArray[b];
+        float reach = b1.radius + b2.radius + CONTACT_MARGIN + Vector2Length(Vector2Subtract(b1.velocity, b2.velocity)) * TIMESTEP;
+        if((isAsleep(b1, settings) && isAsleep(b2, settings)) || Vector2DistanceSqr(b1.position, b2.position) > reach * reach){
+            return;
+        }
+        Vector2 n = Vector2Normalize(Vector2Subtract(b1.position, b2.position));
+        float approachSpeed = -Vector2DotProduct(n, Vector2Subtract(b1.velocity, b2.velocity));
+        Contact contact;
+        contact.a = a;
+        contact.b = b;
+        contact.inverseMass1 = b1.inverse_mass;
+        contact.inverseMass2 = b2.inverse_mass;
+        pinOrWakeSleeper(ballArray, a, b, approachSpeed, settings, physics.islands, contact.inverseMass1, contact.inverseMass2);
+        if(contact.inverseMass1 + contact.inverseMass2 > 0.0f){
+            physics.contacts.push_back(contact);
+        }
+    });
+}
+
+// XPBD: substeps project overlapping pairs apart and derive velocities from the motion.
+void solvePositions(Grid &grid, std::vector<Ball> &ballArray, const SimulationSettings &settings, PhysicsState &physics){
+    findCandidatePairs(grid, ballArray, settings, physics);
+
+    int count = ballArray.size();
+    float h = TIMESTEP / settings.xpbdSubsteps;
+    float damping = std::max(0.0f, 1.0f - settings.linearDamping * h);
+    float alpha = settings.xpbdCompliance / (h * h);
+    float restitutionThreshold = std::max(settings.restitutionThreshold, 2.0f * Vector2Length(settings.gravity) * h * settings.gravityEnabled);
+    std::vector<Contact> &contacts = physics.contacts;
+    physics.previousPositions.resize(count);
+    physics.previousVelocities.resize(count);
+
+    for(int substep = 0; substep < settings.xpbdSubsteps; substep++){
+        for(int k = 0; k < count; k++){
+            Ball &ball = ballArray[k];
+            physics.previousPositions[k] = ball.position;
+            if(isAsleep(ball, settings)){
+                physics.previousVelocities[k] = Vector2Zero();
+                continue;
+            }
+            if(settings.gravityEnabled){
+                ball.velocity = Vector2Scale(Vector2Add(ball.velocity, Vector2Scale(settings.gravity, h)), damping);
+            }
+            if(!physics.forces.empty()){
+                ball.velocity = Vector2Add(ball.velocity, Vector2Scale(physics.forces[k], ball.inverse_mass * h));
+            }
+            physics.previousVelocities[k] = ball.velocity;
+            ball.position = Vector2Add(ball.position, Vector2Scale(ball.velocity, h));
+        }
+
+        for(int c = 0; c < contacts.size(); c++){
+            Contact &contact = contacts[c];
+            Ball &b1 = ballArray[contact.a];
+            Ball &b2 = ballArray[contact.b];
+            Vector2 delta = Vector2Subtract(b1.position, b2.position);
+            float distance = Vector2Length(delta);
+            float overlap = b1.radius + b2.radius - distance;
+            contact.impulse = 0.0f;
+            if(overlap <= 0.0f || distance <= 0.0f){
+                continue;
+            }
+            contact.normal = Vector2Scale(delta, 1.0f / distance);
+            float lambda = overlap / (contact.inverseMass1 + contact.inverseMass2 + alpha);
+            contact.impulse = lambda;
+            b1.position = Vector2Add(b1.position, Vector2Scale(contact.normal, lambda * contact.inverseMass1));
+            b2.position = Vector2Subtract(b2.position, Vector2Scale(contact.normal, lambda * contact.inverseMass2));
+        }
+
+        for(int k = 0; k < count; k++){
+            Ball &ball = ballArray[k];
+            if(isAsleep(ball, settings)){
+                continue;
+            }
+            ball.position.x = Clamp(ball.position.x, ball.radius, settings.world.x - ball.radius);
+            ball.position.y = Clamp(ball.position.y, ball.radius, settings.world.y - ball.radius);
+            Vector2 obstacleNormals[4];
+            int obstacleContacts = 0;
+            Vector2 from = physics.previousPositions[k];
+            Vector2 reach = {ball.radius, ball.radius};
+            forEachObstacleNear(physics.obstacles, Vector2Subtract(componentMin(from, ball.position), reach), Vector2Add(componentMax(from, ball.position), reach), [&](int o){
+                Vector2 n;
+                float depth;
+                if(obstacleContact(physics.obstacles, o, ball.position, ball.radius, from, n, depth)){
+                    ball.position = Vector2Add(ball.position, Vector2Scale(n, depth));
+                    if(obstacleContacts < 4){
+                        obstacleNormals[obstacleContacts++] = n;
+                    }
+                }
+            });
+            ball.velocity = Vector2Scale(Vector2Subtract(ball.position, physics.previousPositions[k]), 1.0f / h);
+
+            // walls reflect the velocity the ball arrived with
+            Vector2 arrival = physics.previousVelocities[k];
+            if((ball.position.x <= ball.radius && arrival.x < 0) || (ball.position.x >= settings.world.x - ball.radius && arrival.x > 0)){
+                ball.velocity.x = std::abs(arrival.x) > restitutionThreshold ? -arrival.x * settings.elasticityCoefficient : 0.0f;
+            }
+            if((ball.position.y <= ball.radius && arrival.y < 0) || (ball.position.y >= settings.world.y - ball.radius && arrival.y > 0)){
+                ball.velocity.y = std::abs(arrival.y) > restitutionThreshold ? -arrival.y * settings.elasticityCoefficient : 0.0f;
+            }
+            for(int c = 0; c < obstacleContacts; c++){
+                Vector2 n = obstacleNormals[c];
+                float arrivalSpeed = Vector2DotProduct(arrival, n);
+                if(arrivalSpeed < 0.0f){
+                    float targetSpeed = -arrivalSpeed > restitutionThreshold ? -arrivalSpeed * settings.elasticityCoefficient : 0.0f;
+                    ball.velocity = Vector2Add(ball.velocity, Vector2Scale(n, targetSpeed - Vector2DotProduct(ball.velocity, n)));
+                }
+            }
+        }
+
+        for(int c = 0; c < contacts.size(); c++){
+            Contact &contact = contacts[c];
+            if(contact.impulse <= 0.0f){
+                continue;
+            }
+            Ball &b1 = ballArray[contact.a];
+            Ball &b2 = ballArray[contact.b];
+            float arrivalSpeed = Vector2DotProduct(Vector2Subtract(physics.previousVelocities[contact.a], physics.previousVelocities[contact.b]), contact.normal);
+            float separatingSpeed = Vector2DotProduct(Vector2Subtract(b1.velocity, b2.velocity), contact.normal);
+            float targetSpeed = -arrivalSpeed > restitutionThreshold ? -arrivalSpeed * settings.elasticityCoefficient : 0.0f;
+            float change = (targetSpeed - separatingSpeed) / (contact.inverseMass1 + contact.inverseMass2);
+            b1.velocity = Vector2Add(b1.velocity, Vector2Scale(contact.normal, change * contact.inverseMass1));
+            b2.velocity = Vector2Subtract(b2.velocity, Vector2Scale(contact.normal, change * contact.inverseMass2));
+            // the pair leaves the substep at targetSpeed whatever split of position and velocity work got it there
+            emitCollisionEvent(physics.events.get(), contact.a, contact.b, Vector2Add(b2.position, Vector2Scale(contact.normal, b2.radius)), contact.normal,
+                               (targetSpeed - arrivalSpeed) / (contact.inverseMass1 + contact.inverseMass2));
+        }
+    }
+
+    if(settings.sleepEnabled){
+        for(int c = 0; c < contacts.size(); c++){
+            if(contacts[c].impulse > 0.0f){
+                joinIslands(physics.islands, contacts[c].a, contacts[c].b);
+            }
+        }
+    }
+}
+
+const int QUADTREE_LEAF_SIZE = 8;
+const int QUADTREE_MAX_DEPTH = 20;
+const int QUADTREE_SPLIT_DEPTH = 2;   // levels built serially before the subtrees are built in parallel
+
+struct PendingSubtree
+{
+    int node;
+    int begin;
+    int end;
+    int depth;
+};
+
+void summarizeQuadNode(std::vector<QuadNode> &nodes, int index, int depth, int stopDepth){
+    QuadNode &node = nodes[index];
+    if(node.firstChild < 0 || depth >= stopDepth){
+        return;
+    }
+    node.mass = 0.0f;
+    node.centerOfMass = Vector2Zero();
+    for(int c = 0; c < 4; c++){
+        summarizeQuadNode(nodes, node.firstChild + c, depth + 1, stopDepth);
+        const QuadNode &child = nodes[node.firstChild + c];
+        node.centerOfMass = Vector2Add(node.centerOfMass, Vector2Scale(child.centerOfMass, child.mass));
+        node.mass += child.mass;
+    }
+    if(node.mass > 0.0f){
+        node.centerOfMass = Vector2Scale(node.centerOfMass, 1.0f / node.mass);
+    }
+}
+
+// Fills nodes[index] for bodies[begin, end); nodes at stopDepth are left in pending for the parallel pass.
+void buildQuadNode(QuadTree &tree, std::vector<QuadNode> &nodes, const std::vector<Ball> &ballArray, int index, Vector2 center, float halfSize,
+                   int begin, int end, int depth, int stopDepth, std::vector<PendingSubtree> *pending){
+    QuadNode node;
+    node.center = center;
+    node.halfSize = halfSize;
+    node.centerOfMass = Vector2Zero();
+    node.mass = 0.0f;
+    node.firstChild = -1;
+    node.firstBody = begin;
+    node.bodyCount = end - begin;
+    nodes[index] = node;
+    if(pending != nullptr && depth == stopDepth){
+        pending->push_back(PendingSubtree{index, begin, end, depth});
+        return;
+    }
+
+    if(end - begin <= QUADTREE_LEAF_SIZE || depth >= QUADTREE_MAX_DEPTH){
+        for(int i = begin; i < end; i++){
+            const Ball &ball = ballArray[tree.bodies[i]];
+            float mass = 1.0f / ball.inverse_mass;
+            node.centerOfMass = Vector2Add(node.centerOfMass, Vector2Scale(ball.position, mass));
+            node.mass += mass;
+        }
+        if(node.mass > 0.0f){
+            node.centerOfMass = Vector2Scale(node.centerOfMass, 1.0f / node.mass);
+        }
+        nodes[index] = node;
+        return;
+    }
+
+    // split the range into the four quadrants: top-left, top-right, bottom-left, bottom-right
+    std::vector<int>::iterator first = tree.bodies.begin() + begin;
+    std::vector<int>::iterator last = tree.bodies.begin() + end;
+    std::vector<int>::iterator middle = std::partition(first, last, [&](int b){ return ballArray[b].position.y < center.y; });
+    std::vector<int>::iterator topMiddle = std::partition(first, middle, [&](int b){ return ballArray[b].position.x < center.x; });
+    std::vector<int>::iterator bottomMiddle = std::partition(middle, last, [&](int b){ return ballArray[b].position.x < center.x; });
+    int bounds[5] = {begin, (int)(topMiddle - tree.bodies.begin()), (int)(middle - tree.bodies.begin()), (int)(bottomMiddle - tree.bodies.begin()), end};
+
+    node.firstChild = nodes.size();
+    nodes[index] = node;
+    nodes.resize(nodes.size() + 4);
+    float quarter = halfSize * 0.5f;
+    for(int c = 0; c < 4; c++){
+        Vector2 childCenter = {center.x + (c % 2 == 0 ? -quarter : quarter), center.y + (c < 2 ? -quarter : quarter)};
+        buildQuadNode(tree, nodes, ballArray, node.firstChild + c, childCenter, quarter, bounds[c], bounds[c + 1], depth + 1, stopDepth, pending);
+    }
+    if(pending == nullptr){
+        summarizeQuadNode(nodes, index, depth, depth + 1);
+    }
+}
+
+// Builds the top levels serially and the subtrees below them in parallel.
+void buildQuadTree(QuadTree &tree, const std::vector<Ball> &ballArray, Vector2 world){
+    int count = ballArray.size();
+    tree.bodies.resize(count);
+    for(int i = 0; i < count; i++){
+        tree.bodies[i] = i;
+    }
+    float halfSize = std::max(world.x, world.y) * 0.5f;
+    tree.nodes.assign(1, QuadNode());
+    std::vector<PendingSubtree> pending;
+    buildQuadNode(tree, tree.nodes, ballArray, 0, Vector2{halfSize, halfSize}, halfSize, 0, count, 0, QUADTREE_SPLIT_DEPTH, &pending);
+
+    tree.subtrees.resize(pending.size());
+    workerPool().parallelFor(pending.size(), [&](int begin, int end){
+        for(int p = begin; p < end; p++){
+            const QuadNode &root = tree.nodes[pending[p].node];
+            std::vector<QuadNode> &subtree = tree.subtrees[p];
+            subtree.assign(1, QuadNode());
+            buildQuadNode(tree, subtree, ballArray, 0, root.center, root.halfSize, pending[p].begin, pending[p].end, pending[p].depth, -1, nullptr);
+        }
+    });
+
+    for(int p = 0; p < pending.size(); p++){
+        std::vector<QuadNode> &subtree = tree.subtrees[p];
+        int offset = tree.nodes.size() - 1;
+        for(int n = 0; n < subtree.size(); n++){
+            if(subtree[n].firstChild >= 0){
+                subtree[n].firstChild += offset;
+            }
+        }
+        tree.nodes[pending[p].node] = subtree[0];
+        tree.nodes.insert(tree.nodes.end(), subtree.begin() + 1, subtree.end());
+    }
+    summarizeQuadNode(tree.nodes, 0, 0, QUADTREE_SPLIT_DEPTH);
+}
+
+Vector2 attraction(Vector2 position, Vector2 source, float sourceMass, float softeningSq){
+    Vector2 delta = Vector2Subtract(source, position);
+    float distanceSq = Vector2LengthSqr(delta) + softeningSq;
+    return Vector2Scale(delta, sourceMass / (distanceSq * std::sqrt(distanceSq)));
+}
+
+// Barnes-Hut attraction: distant groups of balls act through their center of mass.
+void computeAttraction(QuadTree &tree, const std::vector<Ball> &ballArray, const SimulationSettings &settings, std::vector<Vector2> &forces){
+    if(ballArray.empty()){
+        return;
+    }
+    buildQuadTree(tree, ballArray, settings.world);
+    float softeningSq = settings.softening * settings.softening;
+    float openingAngleSq = settings.openingAngle * settings.openingAngle;
+
+    workerPool().parallelFor(ballArray.size(), [&](int begin, int end){
+        std::vector<int> stack;
+        for(int i = begin; i < end; i++){
+            Vector2 position = ballArray[i].position;
+            Vector2 acceleration = Vector2Zero();
+            stack.assign(1, 0);
+            while(!stack.empty()){
+                const QuadNode &node = tree.nodes[stack.back()];
+                stack.pop_back();
+                if(node.mass <= 0.0f){
+                    continue;
+                }
+                if(node.firstChild < 0){
+                    for(int b = node.firstBody; b < node.firstBody + node.bodyCount; b++){
+                        int other = tree.bodies[b];
+                        if(other != i){
+                            acceleration = Vector2Add(acceleration, attraction(position, ballArray[other].position, 1.0f / ballArray[other].inverse_mass, softeningSq));
+                        }
+                    }
+                    continue;
+                }
+                float size = node.halfSize * 2.0f;
+                if(size * size < openingAngleSq * Vector2DistanceSqr(position, node.centerOfMass)){
+                    acceleration = Vector2Add(acceleration, attraction(position, node.centerOfMass, node.mass, softeningSq));
+                    continue;
+                }
+                for(int c = 0; c < 4; c++){
+                    stack.push_back(node.firstChild + c);
+                }
+            }
+            forces[i] = Vector2Add(forces[i], Vector2Scale(acceleration, settings.gravitationalConstant / ballArray[i].inverse_mass));
+        }
+    });
+}
+
+// Calls neighbourFunction(i, j, delta, distanceSq) for each j within radius of i, i included; calls for one i stay on one thread.
+template <typename NeighbourFunction>
+void forEachNeighbour(Grid &grid, const std::vector<Ball> &ballArray, float radius, NeighbourFunction neighbourFunction){
+    int reach = (int)std::ceil(radius / grid.cellSize);
+    float radiusSq = radius * radius;
+    workerPool().parallelFor(grid.size(), [&](int rowBegin, int rowEnd){
+        std::vector<int> neighbours;
+        std::vector<Vector2> neighbourPositions;
+        for(int i = rowBegin; i < rowEnd; i++){
+            for(int j = 0; j < grid[i].size(); j++){
+                const std::vector<int> &balls = grid[i][j].ballsInCell;
+                if(balls.empty()){
+                    continue;
+                }
+                neighbours.clear();
+                neighbourPositions.clear();
+                for(int ni = std::max(0, i - reach); ni <= std::min((int)grid.size() - 1, i + reach); ni++){
+                    for(int nj = std::max(0, j - reach); nj <= std::min((int)grid[ni].size() - 1, j + reach); nj++){
+                        for(int n : grid[ni][nj].ballsInCell){
+                            neighbours.push_back(n);
+                            neighbourPositions.push_back(ballArray[n].position);
+                        }
+                    }
+                }
+                for(int b : balls){
+                    Vector2 position = ballArray[b].position;
+                    for(int n = 0; n < neighbours.size(); n++){
+                        Vector2 delta = Vector2Subtract(position, neighbourPositions[n]);
+                        float distanceSq = Vector2LengthSqr(delta);
+                        if(distanceSq < radiusSq){
+                            neighbourFunction(b, neighbours[n], delta, distanceSq);
+                        }
+                    }
+                }
+            }
+        }
+    });
+}
+
+SimulationSettings fluidModeSettings(){
+    SimulationSettings settings;
+    settings.fluid = true;
+    settings.gravityEnabled = true;
+    settings.elasticityCoefficient = 0.3f;
+    settings.continuousCollision = false;
+    settings.maxSpeed = 0.5f * settings.fluidSmoothingLength / TIMESTEP; // keeps particles from skipping a kernel radius per step
+    return settings;
+}
+
+// SPH (Mueller et al. 2003): adds pressure and viscosity forces to physics.forces.
+void computeFluidForces(Grid &grid, const std::vector<Ball> &ballArray, const SimulationSettings &settings, PhysicsState &physics){
+    int count = ballArray.size();
+    float h = settings.fluidSmoothingLength;
+    float hSq = h * h;
+    float poly6 = 4.0f / (PI * std::pow(h, 8.0f));
+    float spikyGradient = -30.0f / (PI * std::pow(h, 5.0f));
+    float viscosityLaplacian = 40.0f / (PI * std::pow(h, 5.0f));
+    std::vector<float> &densities = physics.fluidDensities;
+    std::vector<float> &pressures = physics.fluidPressures;
+    densities.assign(count, 0.0f);
+    pressures.resize(count);
+
+    forEachNeighbour(grid, ballArray, h, [&](int i, int j, Vector2 delta, float distanceSq){
+        float w = hSq - distanceSq;
+        densities[i] += w * w * w * poly6 / ballArray[j].inverse_mass;
+    });
+    for(int i = 0; i < count; i++){
+        pressures[i] = std::max(0.0f, settings.fluidStiffness * (densities[i] - settings.fluidRestDensity));
+    }
+
+    std::vector<Vector2> &forces = physics.forces;
+    forEachNeighbour(grid, ballArray, h, [&](int i, int j, Vector2 delta, float distanceSq){
+        if(i == j || distanceSq <= 0.0f){
+            return;
+        }
+        float distance = std::sqrt(distanceSq);
+        float massOverDensity = 1.0f / (ballArray[j].inverse_mass * densities[j]);
+        float pressure = -(pressures[i] + pressures[j]) * 0.5f * massOverDensity * spikyGradient * (h - distance) * (h - distance);
+        Vector2 force = Vector2Scale(delta, pressure / distance);
+        Vector2 relativeVelocity = Vector2Subtract(ballArray[j].velocity, ballArray[i].velocity);
+        force = Vector2Add(force, Vector2Scale(relativeVelocity, settings.fluidViscosity * massOverDensity * viscosityLaplacian * (h - distance)));
+        // forces are per unit volume, scale by the particle's own volume
+        forces[i] = Vector2Add(forces[i], Vector2Scale(force, 1.0f / (ballArray[i].inverse_mass * densities[i])));
+    });
+}
+
+void checkCollisionInCell(Grid &grid, const SimulationSettings &settings, std::vector<Ball> &ballArray, PhysicsState &physics){
+    SleepIslands &islands = physics.islands;
+    if(settings.sleepEnabled){
+        islands.parent.resize(ballArray.size());
+        for(int i = 0; i < ballArray.size(); i++){
+            if(!isAsleep(ballArray[i], settings)){
+                islands.parent[i] = i;
+            }
+        }
+    }
+
+    if(settings.nBodyGravity || settings.fluid){
+        physics.forces.assign(ballArray.size(), Vector2Zero());
+    }
+    else{
+        physics.forces.clear();
+    }
+    if(settings.nBodyGravity){
+        computeAttraction(physics.quadTree, ballArray, settings, physics.forces);
+    }
+    if(settings.fluid){
+        updateCellContents(grid, ballArray);
+        computeFluidForces(grid, ballArray, settings, physics);
+        integrateBalls(grid, ballArray, settings, physics);
+        return;
+    }
+
+    if(settings.solver == SOLVER_XPBD){
+        updateCellContents(grid, ballArray);
+        solvePositions(grid, ballArray, settings, physics);
+        if(settings.sleepEnabled){
+            updateSleep(ballArray, settings, islands);
+        }
+        return;
+    }
+
+    integrateBalls(grid, ballArray, settings, physics);
+    updateCellContents(grid, ballArray);
+
+    if(settings.solver == SOLVER_SEQUENTIAL_IMPULSE){
+        findContacts(grid, ballArray, settings, physics);
+        solveContacts(ballArray, settings, physics);
+    }
+    else{
+        forEachNearbyPair(grid, [&](int a, int b){
+            collideBalls(ballArray, a, b, settings, islands, physics.events.get());
+        });
+
+        // position correction can push balls back into the walls
+        if(settings.positionCorrection > 0.0f){
+            for(int k = 0; k < ballArray.size(); k++){
+                if(!isAsleep(ballArray[k], settings)){
+                    collideWalls(ballArray[k], settings);
+                    collideObstacles(ballArray[k], ballArray[k].position, physics.obstacles, settings);
+                }
+            }
+        }
+    }
+
+    if(settings.sleepEnabled){
+        updateSleep(ballArray, settings, islands);
+    }
+}
+
+// Counter-based generator (Philox4x32-10): value i of a stream depends only on the seed, the stream and i.
+struct PhiloxRandom
+{
+    uint32_t key[2];
+    uint32_t stream[2];
+    uint64_t position = 0; // index of the next value
+
+    PhiloxRandom(uint64_t seed, uint64_t streamId, uint64_t position = 0) : position(position) {
+        key[0] = (uint32_t)seed;
+        key[1] = (uint32_t)(seed >> 32);
+        stream[0] = (uint32_t)streamId;
+        stream[1] = (uint32_t)(streamId >> 32);
+    }
+
+    // The four values at indices 4 * blockIndex to 4 * blockIndex + 3
+    void block(uint64_t blockIndex, uint32_t out[4]) const {
+        uint32_t c0 = (uint32_t)blockIndex, c1 = (uint32_t)(blockIndex >> 32), c2 = stream[0], c3 = stream[1];
+        uint32_t k0 = key[0], k1 = key[1];
+        for(int round = 0; round < 10; round++){
+            uint64_t p0 = (uint64_t)0xD2511F53u * c0;
+            uint64_t p1 = (uint64_t)0xCD9E8D57u * c2;
+            uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+            uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+            c1 = (uint32_t)p1;
+            c3 = (uint32_t)p0;
+            c0 = n0;
+            c2 = n2;
+            k0 += 0x9E3779B9u;
+            k1 += 0xBB67AE85u;
+        }
+        out[0] = c0;
+        out[1] = c1;
+        out[2] = c2;
+        out[3] = c3;
+    }
+
+    static float toFloat(uint32_t value){
+        return (value >> 8) * (1.0f / 16777215.0f);
+    }
+
+    uint32_t at(uint64_t index) const {
+        uint32_t out[4];
+        block(index / 4, out);
+        return out[index % 4];
+    }
+
+    uint32_t next(){
+        return at(position++);
+    }
+
+    // Uniform in [0, 1]
+    float nextFloat(){
+        return toFloat(next());
+    }
+
+    // Uniform in [min, max], like GetRandomValue
+    int nextInt(int min, int max){
+        return min + (int)(next() % (uint64_t)((int64_t)max - min + 1));
+    }
+
+    // Values first to first + count - 1 as floats in [0, 1], a block of four at a time
+    void fillFloatsAt(float *values, uint64_t first, int count) const {
+        int i = 0;
+        while(i < count){
+            uint64_t index = first + i;
+            uint32_t out[4];
+            block(index / 4, out);
+            for(int lane = index % 4; lane < 4 && i < count; lane++, i++){
+                values[i] = toFloat(out[lane]);
+            }
+        }
+    }
+
+    // The next count values of nextFloat, split over the worker pool when large.
+    void fillFloats(float *values, int count){
+        uint64_t first = position;
+        if(count >= 4096){
+            workerPool().parallelFor(count, [&](int begin, int end){
+                fillFloatsAt(values + begin, first + begin, end - begin);
+            });
+        }
+        else{
+            fillFloatsAt(values, first, count);
+        }
+        position += count;
+    }
+};
+
+// LoadRandomSequence drawn from a Philox stream: count distinct values in [min, max], NULL if there are not enough.
+int *LoadSimRandomSequence(unsigned int count, int min, int max, PhiloxRandom &random)
+{
+    if(min > max){
+        std::swap(min, max);
+    }
+    uint64_t range = (uint64_t)((int64_t)max - min) + 1;
+    if(count > range){
+        return NULL;
+    }
+    int *values = (int *)RL_CALLOC(count, sizeof(int));
+    if(range <= 4 * (uint64_t)count){
+        // dense: shuffle the first count places of the whole range
+        std::vector<int> all(range);
+        for(uint64_t k = 0; k < range; k++){
+            all[k] = (int)(min + (int64_t)k);
+        }
+        for(unsigned int i = 0; i < count; i++){
+            uint64_t j = i + random.next() % (range - i);
+            std::swap(all[i], all[j]);
+            values[i] = all[i];
+        }
+    }
+    else{
+        // sparse: draw until each value is new, which rarely takes more than a couple of tries
+        std::unordered_set<int> used;
+        for(unsigned int i = 0; i < count;){
+            int value = (int)(min + (int64_t)(random.next() % range));
+            if(used.insert(value).second){
+                values[i++] = value;
+            }
+        }
+    }
+    return values;
+}
+
+float RandomDirection(PhiloxRandom &random)
+{
+    float x = random.nextFloat();
+
+    // Make it [-1, 1]
+    return x * 2.0f - 1.0f;
+}
+
+const uint64_t SPAWN_STREAM_BASE = 1ull << 32; // Philox stream of the first SPACE spawn; emitters use the ones below
+const uint64_t SPAWN_VALUES_PER_BALL = 8;      // stretch of the spawn's stream each ball draws from
+
+// Ball i of the spawn draws only from its own stretch of stream, so the balls come out the same in any order.
+void InitializeBall(std::vector<Ball> &array, std::vector<BallRender> &renderArray, std::vector<BallInfo> &infoArray, int arraySize, bool isLarge, int spawnInstance, Vector2 position, uint64_t seed, uint64_t stream)
+{
+    for (size_t i = 0; i < arraySize; i++)
+    {
+        Ball ball;
+        BallInfo info;
+        PhiloxRandom random(seed, stream, i * SPAWN_VALUES_PER_BALL);
+        Color randomColor = {
+            (unsigned char)random.nextInt(0, 255),
+            (unsigned char)random.nextInt(0, 255),
+            (unsigned char)random.nextInt(0, 255),
+            255};
+        ball.position = position;
+        if (isLarge)
+        {
+            ball.radius = MAX_BALL_RADIUS;
+            info.mass = 10.0f;
+            ball.inverse_mass = 1.0f / 10.0f;
+        }
+        else
+        {
+            ball.radius = (float)random.nextInt(5, 10);
+            info.mass = 1.0f;
+            ball.inverse_mass = 1.0f;
+        }
+        info.color = randomColor;
+        info.spawnInstance = spawnInstance;
+        ball.velocity = {500.0f * RandomDirection(random), 500.0f * RandomDirection(random)};
+        ball.sleepCounter = 0;
+        array.push_back(ball);
+        renderArray.push_back(BallRender{quantizeRadius(ball.radius), quantizeColor(randomColor)});
+        infoArray.push_back(info);
+    }
+}
+
+Vector2 getCenterOfRectangle(Vector2 RectanglePos, float width, float height){ // ( (x1 + x2) / 2, (y1 + y2) / 2 )
     return Vector2{(RectanglePos.x + width)/2, (RectanglePos.y + height)/2};
 }
 
-int main()
+// Sprays balls at a steady rate in a cone, for stress tests and fountains.
+struct Emitter
+{
+    Vector2 position = {0.0f, 0.0f}; // in world coordinates, set by whoever adds the emitter
+    float rate = 1000.0f;         // balls per second
+    float direction = -PI / 2.0f; // center of the cone in radians, straight up by default
+    float spread = PI / 6.0f;     // half-angle of the cone
+    float speedMin = 300.0f;
+    float speedMax = 600.0f;
+    float radiusMin = 3.0f;
+    float radiusMax = 6.0f;       // at most MAX_BALL_RADIUS
+    float lifetime = 0.0f;        // seconds, 0 keeps the balls
+    float owed = 0.0f;            // fraction of a ball carried over to the next step
+    uint64_t drawn = 0;           // random values used so far, the emitter's place in its stream
+};
+
+// FNV-1a over the raw ball state, for comparing runs against recorded golden hashes.
+uint64_t hashBallState(const std::vector<Ball> &ballArray){
+    uint64_t hash = 0xCBF29CE484222325ull;
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(ballArray.data());
+    for(size_t i = 0; i < ballArray.size() * sizeof(Ball); i++){
+        hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+const int REWIND_KEYFRAME_INTERVAL = 30;          // steps between full copies; bounds how many deltas a seek replays
+const float REWIND_POSITION_STEP = 1.0f / 256.0f; // quantization of position residuals, in pixels
+const float REWIND_VELOCITY_STEP = 1.0f / 16.0f;  // quantization of velocity deltas, in pixels per second
+const int REWIND_DELTA_BYTES = 9;                 // per ball in a delta frame: four int16 values and the sleep counter
+
+struct RewindState
+{
+    std::vector<Ball> balls;
+    std::vector<BallRender> render;
+    std::vector<BallInfo> info;
+    int stepCount = 0;
+    int spawnInstance = 0;
+    uint64_t spawnCount = 0;
+    SimulationSettings settings;
+    std::vector<Emitter> emitters;
+};
+
+// One recorded step, DEFLATE compressed: the ball arrays for a keyframe, else int16 deltas then spawned balls.
+struct RewindFrame
+{
+    bool keyframe = false;
+    bool remapped = false; // deltas are preceded by each ball's previous-frame index, -1 for spawned ones
+    int ballCount = 0;
+    int keptCount = 0;  // balls carried over from the previous frame
+    int rawSize = 0;
+    int stepCount = 0;
+    int spawnInstance = 0;
+    uint64_t spawnCount = 0;
+    SimulationSettings settings;
+    std::vector<Emitter> emitters; // few enough to keep uncompressed
+    std::vector<unsigned char> data;
+};
+
+// The last few seconds as keyframes plus deltas against the rebuilt state, so rounding never accumulates.
+struct RewindBuffer
+{
+    int capacity = 0; // frames kept, 0 turns recording off
+    std::deque<RewindFrame> frames;
+    RewindState last;   // rebuilt state of the newest frame
+    RewindState cursor; // rebuilt state of frame cursorIndex while scrubbing
+    int cursorIndex = -1;
+    int stepsSinceKeyframe = 0;
+    size_t rawBytes = 0;
+    size_t compressedBytes = 0;
+    std::unique_ptr<sdefl> compressor;
+    std::vector<unsigned char> raw;
+    std::vector<Ball> pending;
+    std::vector<int32_t> sources; // previous-frame index of each ball, -1 if spawned since
+    std::vector<int> slotIndex;   // previous-frame index by handle slot, -1 for none
+    RewindState reordered;        // decodeFrame scratch
+
+    void compress(RewindFrame &frame){
+        frame.rawSize = raw.size();
+        frame.data.clear();
+        if(!raw.empty()){
+            if(!compressor){
+                compressor.reset(new sdefl());
+            }
+            frame.data.resize(sdefl_bound(raw.size()));
+            int size = sdeflate(compressor.get(), frame.data.data(), raw.data(), raw.size(), SDEFL_LVL_MIN);
+            // sinflate peeks a few bytes past the last code at the end of the stream, zeros there are ignored
+            frame.data.resize(size + 8);
+            std::fill(frame.data.begin() + size, frame.data.end(), 0);
+            frame.data.shrink_to_fit();
+        }
+        rawBytes += frame.rawSize;
+        compressedBytes += frame.data.size();
+    }
+
+    template <typename T>
+    void appendRaw(const T *items, size_t count){
+        const unsigned char *bytes = reinterpret_cast<const unsigned char *>(items);
+        raw.insert(raw.end(), bytes, bytes + count * sizeof(T));
+    }
+
+    // Finds each ball's previous-frame index by handle, -1 if spawned since; returns whether any kept ball moved.
+    bool matchKeptBalls(const std::vector<BallInfo> &info, int &kept){
+        slotIndex.clear();
+        for(int i = 0; i < last.info.size(); i++){
+            if(last.info[i].slot >= slotIndex.size()){
+                slotIndex.resize(last.info[i].slot + 1, -1);
+            }
+            slotIndex[last.info[i].slot] = i;
+        }
+        sources.resize(info.size());
+        kept = 0;
+        bool moved = false;
+        for(int i = 0; i < info.size(); i++){
+            int source = info[i].slot < slotIndex.size() ? slotIndex[info[i].slot] : -1;
+            if(source >= 0 && last.info[source].generation != info[i].generation){
+                source = -1;
+            }
+            sources[i] = source;
+            if(source >= 0){
+                moved = moved || source != i || kept != i;
+                kept++;
+            }
+        }
+        return moved || kept != last.info.size();
+    }
+
+    // Writes the kept balls' deltas into raw and the rebuilt balls into pending; fails if a value overflows.
+    bool encodeDelta(const std::vector<Ball> &balls, int kept, bool remapped){
+        raw.clear();
+        if(remapped){
+            appendRaw(sources.data(), sources.size());
+        }
+        size_t start = raw.size();
+        raw.resize(start + kept * REWIND_DELTA_BYTES);
+        int16_t *channels = reinterpret_cast<int16_t *>(raw.data() + start); // four arrays of kept values each
+        unsigned char *sleepCounters = raw.data() + start + 8 * kept;
+        pending.clear();
+        int j = 0;
+        for(int i = 0; i < balls.size(); i++){
+            if(sources[i] < 0){
+                pending.push_back(balls[i]);
+                continue;
+            }
+            Ball rebuilt = last.balls[sources[i]];
+            Vector2 predicted = Vector2Add(rebuilt.position, Vector2Scale(rebuilt.velocity, TIMESTEP));
+            float values[4] = {(balls[i].position.x - predicted.x) / REWIND_POSITION_STEP, (balls[i].position.y - predicted.y) / REWIND_POSITION_STEP,
+                               (balls[i].velocity.x - rebuilt.velocity.x) / REWIND_VELOCITY_STEP, (balls[i].velocity.y - rebuilt.velocity.y) / REWIND_VELOCITY_STEP};
+            int16_t quantized[4];
+            for(int c = 0; c < 4; c++){
+                if(!(std::fabs(values[c]) < 32767.0f)){
+                    return false;
+                }
+                quantized[c] = (int16_t)std::lround(values[c]);
+                channels[c * kept + j] = quantized[c];
+            }
+            uint8_t sleep = (uint8_t)std::min(balls[i].sleepCounter, 255);
+            sleepCounters[j] = sleep;
+            applyDelta(rebuilt, quantized, sleep);
+            pending.push_back(rebuilt);
+            j++;
+        }
+        return true;
+    }
+
+    static void applyDelta(Ball &ball, const int16_t quantized[4], uint8_t sleep){
+        Vector2 predicted = Vector2Add(ball.position, Vector2Scale(ball.velocity, TIMESTEP));
+        ball.position = {predicted.x + quantized[0] * REWIND_POSITION_STEP, predicted.y + quantized[1] * REWIND_POSITION_STEP};
+        ball.velocity = {ball.velocity.x + quantized[2] * REWIND_VELOCITY_STEP, ball.velocity.y + quantized[3] * REWIND_VELOCITY_STEP};
+        ball.sleepCounter = sleep;
+    }
+
+    void record(const std::vector<Ball> &balls, const std::vector<BallRender> &render, const std::vector<BallInfo> &info,
+                int stepCount, int spawnInstance, uint64_t spawnCount, const SimulationSettings &settings, const std::vector<Emitter> &emitters){
+        if(capacity <= 0){
+            return;
+        }
+        RewindFrame frame;
+        frame.ballCount = balls.size();
+        frame.stepCount = stepCount;
+        frame.spawnInstance = spawnInstance;
+        frame.spawnCount = spawnCount;
+        frame.settings = settings;
+        frame.emitters = emitters;
+        // a remap costs four bytes per ball, so a keyframe only pays when few balls were kept
+        int kept = 0;
+        frame.remapped = matchKeptBalls(info, kept);
+        frame.keptCount = kept;
+        size_t remapBytes = frame.remapped ? balls.size() * sizeof(int32_t) : 0;
+        bool deltaPays = remapBytes + kept * REWIND_DELTA_BYTES < kept * (sizeof(Ball) + sizeof(BallRender) + sizeof(BallInfo));
+        frame.keyframe = frames.empty() || stepsSinceKeyframe + 1 >= REWIND_KEYFRAME_INTERVAL || !deltaPays || !encodeDelta(balls, kept, frame.remapped);
+        if(frame.keyframe){
+            frame.remapped = false;
+            frame.keptCount = 0;
+            raw.clear();
+            appendRaw(balls.data(), balls.size());
+            appendRaw(render.data(), render.size());
+            appendRaw(info.data(), info.size());
+            last.balls = balls;
+            stepsSinceKeyframe = 0;
+        }
+        else{
+            for(int i = 0; i < balls.size(); i++){
+                if(sources[i] < 0){
+                    appendRaw(&balls[i], 1);
+                }
+            }
+            for(int i = 0; i < balls.size(); i++){
+                if(sources[i] < 0){
+                    appendRaw(&render[i], 1);
+                }
+            }
+            for(int i = 0; i < balls.size(); i++){
+                if(sources[i] < 0){
+                    appendRaw(&info[i], 1);
+                }
+            }
+            last.balls.swap(pending);
+            stepsSinceKeyframe++;
+        }
+        last.render = render;
+        last.info = info;
+        last.stepCount = stepCount;
+        last.spawnInstance = spawnInstance;
+        last.spawnCount = spawnCount;
+        last.settings = settings;
+        last.emitters = emitters;
+        compress(frame);
+        frames.push_back(std::move(frame));
+
+        // forget the oldest keyframe group once it is no longer needed to stay within capacity
+        while(frames.size() > capacity){
+            do{
+                rawBytes -= frames.front().rawSize;
+                compressedBytes -= frames.front().data.size();
+                frames.pop_front();
+            } while(!frames.empty() && !frames.front().keyframe);
+        }
+    }
+
+    // Applies one frame on top of state, which must hold the frame before it unless this is a keyframe.
+    void decodeFrame(const RewindFrame &frame, RewindState &state){
+        raw.resize(frame.rawSize);
+        if(frame.rawSize > 0){
+            sinflate(raw.data(), raw.size(), frame.data.data(), frame.data.size());
+        }
+        int kept = frame.keptCount;
+        int added = frame.ballCount - kept;
+        const unsigned char *deltas = raw.data() + (frame.remapped ? frame.ballCount * sizeof(int32_t) : 0);
+        const int16_t *channels = reinterpret_cast<const int16_t *>(deltas);
+        const unsigned char *sleepCounters = deltas + 8 * kept;
+        // spawned balls follow the 9 byte deltas unaligned, so they are copied out rather than read in place
+        const unsigned char *balls = deltas + kept * REWIND_DELTA_BYTES;
+        const unsigned char *render = balls + added * sizeof(Ball);
+        const unsigned char *info = render + added * sizeof(BallRender);
+        if(!frame.remapped){
+            for(int i = 0; i < kept; i++){
+                int16_t quantized[4] = {channels[i], channels[kept + i], channels[2 * kept + i], channels[3 * kept + i]};
+                applyDelta(state.balls[i], quantized, sleepCounters[i]);
+            }
+            state.balls.resize(frame.ballCount);
+            state.render.resize(frame.ballCount);
+            state.info.resize(frame.ballCount);
+            std::memcpy(state.balls.data() + kept, balls, added * sizeof(Ball));
+            std::memcpy(state.render.data() + kept, render, added * sizeof(BallRender));
+            std::memcpy(state.info.data() + kept, info, added * sizeof(BallInfo));
+        }
+        else{
+            // kept balls are gathered from where the previous frame had them, spawned ones fill the rest in order
+            const int32_t *sources = reinterpret_cast<const int32_t *>(raw.data());
+            reordered.balls.clear();
+            reordered.render.clear();
+            reordered.info.clear();
+            int j = 0;
+            int n = 0;
+            for(int i = 0; i < frame.ballCount; i++){
+                if(sources[i] < 0){
+                    Ball ball;
+                    BallRender ballRender;
+                    BallInfo ballInfo;
+                    std::memcpy(&ball, balls + n * sizeof(Ball), sizeof(Ball));
+                    std::memcpy(&ballRender, render + n * sizeof(BallRender), sizeof(BallRender));
+                    std::memcpy(&ballInfo, info + n * sizeof(BallInfo), sizeof(BallInfo));
+                    reordered.balls.push_back(ball);
+                    reordered.render.push_back(ballRender);
+                    reordered.info.push_back(ballInfo);
+                    n++;
+                    continue;
+                }
+                Ball ball = state.balls[sources[i]];
+                int16_t quantized[4] = {channels[j], channels[kept + j], channels[2 * kept + j], channels[3 * kept + j]};
+                applyDelta(ball, quantized, sleepCounters[j]);
+                reordered.balls.push_back(ball);
+                reordered.render.push_back(state.render[sources[i]]);
+                reordered.info.push_back(state.info[sources[i]]);
+                j++;
+            }
+            state.balls.swap(reordered.balls);
+            state.render.swap(reordered.render);
+            state.info.swap(reordered.info);
+        }
+        state.stepCount = frame.stepCount;
+        state.spawnInstance = frame.spawnInstance;
+        state.spawnCount = frame.spawnCount;
+        state.settings = frame.settings;
+        state.emitters = frame.emitters;
+    }
+
+    // Rebuilds frame index into cursor, from the nearest keyframe when going back.
+    void seek(int index){
+        index = Clamp(index, 0, (int)frames.size() - 1);
+        int start = cursorIndex + 1;
+        if(cursorIndex < 0 || index < cursorIndex){
+            start = index;
+            while(!frames[start].keyframe){
+                start--;
+            }
+        }
+        for(int f = start; f <= index; f++){
+            decodeFrame(frames[f], cursor);
+        }
+        cursorIndex = index;
+    }
+
+    // Drops everything recorded after the cursor so recording carries on from there.
+    void truncateAfterCursor(){
+        while(frames.size() > cursorIndex + 1){
+            rawBytes -= frames.back().rawSize;
+            compressedBytes -= frames.back().data.size();
+            frames.pop_back();
+        }
+        last = cursor;
+        stepsSinceKeyframe = 0;
+        for(int f = frames.size() - 1; f >= 0 && !frames[f].keyframe; f--){
+            stepsSinceKeyframe++;
+        }
+    }
+};
+
+// A stable reference to a ball; it goes stale once the ball is removed.
+struct BallHandle
+{
+    uint32_t slot = 0;
+    uint32_t generation = 0;
+};
+
+struct BallHandles
+{
+    std::vector<int> indices;          // per slot: the ball's index in the arrays, -1 while free
+    std::vector<uint32_t> generations; // per slot: generation of its ball, or the one its next ball will get
+    std::vector<uint32_t> issued;      // per slot: highest generation ever given out, so none is repeated
+    std::vector<uint32_t> freeSlots;   // reused before the table grows
+
+    uint32_t allocate(int index){
+        uint32_t slot;
+        if(!freeSlots.empty()){
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+        }
+        else{
+            slot = indices.size();
+            indices.push_back(-1);
+            generations.push_back(0);
+            issued.push_back(0);
+        }
+        indices[slot] = index;
+        return slot;
+    }
+
+    void release(uint32_t slot){
+        indices[slot] = -1;
+        generations[slot] = ++issued[slot];
+        freeSlots.push_back(slot);
+    }
+
+    // Index of the ball the handle refers to, or -1 if it has been removed.
+    int resolve(BallHandle handle) const {
+        if(handle.slot >= indices.size() || generations[handle.slot] != handle.generation){
+            return -1;
+        }
+        return indices[handle.slot];
+    }
+
+    // After the arrays were replaced wholesale: takes each ball's slot from its info, reissuing duplicates.
+    void rebuild(std::vector<BallInfo> &info){
+        std::fill(indices.begin(), indices.end(), -1);
+        std::vector<int> unplaced;
+        for(int k = 0; k < info.size(); k++){
+            uint32_t slot = info[k].slot;
+            if(slot >= indices.size()){
+                indices.resize(slot + 1, -1);
+                generations.resize(slot + 1, 0);
+                issued.resize(slot + 1, 0);
+            }
+            if(indices[slot] >= 0){
+                unplaced.push_back(k);
+                continue;
+            }
+            indices[slot] = k;
+            generations[slot] = info[k].generation;
+            issued[slot] = std::max(issued[slot], info[k].generation);
+        }
+        freeSlots.clear();
+        for(int slot = indices.size() - 1; slot >= 0; slot--){
+            if(indices[slot] < 0){
+                generations[slot] = ++issued[slot];
+                freeSlots.push_back(slot);
+            }
+        }
+        for(int k : unplaced){
+            info[k].slot = allocate(k);
+            info[k].generation = generations[info[k].slot];
+        }
+    }
+};
+
+// Mouse tools, applied by the simulation to the balls a grid query finds under the brush.
+enum PointerTool
+{
+    TOOL_DRAG, // grab what is under the brush on press and carry it along, letting go throws it
+    TOOL_PUSH,
+    TOOL_PULL,
+    TOOL_ERASE,
+    POINTER_TOOL_COUNT
+};
+
+const char *pointerToolName(PointerTool tool){
+    switch(tool){
+    case TOOL_PUSH: return "push";
+    case TOOL_PULL: return "pull";
+    case TOOL_ERASE: return "erase";
+    default: return "drag";
+    }
+}
+
+const float DRAG_STIFFNESS = 0.5f;    // share of the gap to its grab point a dragged ball closes each step
+const float BRUSH_STRENGTH = 4000.0f; // push and pull acceleration at the brush center, fading to 0 at its edge
+
+// The newest mouse state from the window. Only the latest matters, so it is overwritten rather than queued.
+struct PointerInput
+{
+    Vector2 position = {0.0f, 0.0f};
+    bool held = false;
+    PointerTool tool = TOOL_DRAG;
+    float radius = 60.0f;
+};
+
+struct PointerState
+{
+    PointerInput input;
+    bool wasHeld = false;
+    std::vector<BallHandle> grabbed;  // balls held by the drag tool
+    std::vector<Vector2> grabOffsets; // where each sits relative to the pointer
+    std::vector<int> found;           // brush query results, kept for their capacity
+    std::vector<bool> erasing;        // erase tool marks, likewise
+    int touched = 0;                  // balls the tool acted on last step
+};
+
+// Periodically times a few candidate cell sizes on the live scene and switches to the fastest; off in deterministic runs.
+struct CellSizeTuner
+{
+    bool enabled = false;
+    int interval = 600;      // steps between rounds
+    int repeats = 2;         // timings per candidate; the fastest counts
+    float margin = 0.9f;     // a new size must take at most this fraction of the current one's time
+    int nextStep = 120;
+    Grid scratch;            // candidates are timed here, leaving the scene's grid alone until a switch
+    std::vector<int> neighbourCounts;
+    char decision[64] = "";  // outcome of the last round, for the overlay; not TextFormat, which is the window's
+};
+
+// Everything one simulation owns. The simulation thread is the only one that touches it once running.
+struct Scene
+{
+    SimulationSettings settings;
+    PhysicsState physics;
+    std::vector<Ball> ballArray;
+    std::vector<BallRender> renderArray;
+    std::vector<BallInfo> infoArray;
+    Grid grid;
+    std::vector<Vector2> previousPositions; // positions before the last step, for drawing between steps
+    int spawnInstance = 0;
+    int stepCount = 0;
+    uint64_t seed;
+    uint64_t spawnCount = 0; // SPACE spawns so far, each drawing from its own Philox stream
+    std::string snapshotPath = "scene.snap"; // file used by the save and load commands
+    RewindBuffer rewind;
+    bool rewinding = false; // paused and scrubbing through rewind history
+    bool scrubbed = false;  // the scene was replaced by a recorded state since rewinding started
+    PointerState pointer;
+    BallHandles handles;
+    float ballLifetime = 0.0f;     // seconds before a spawned ball is despawned, 0 keeps balls forever
+    bool despawnOffscreen = false; // remove balls whose center left the world instead of letting the walls push them back
+    bool ballsExpire = false;      // some ball has an expiry step; until then the despawn scan is skipped
+    std::vector<Emitter> emitters;
+    bool emittersOn = true;
+    std::vector<int> despawnRemap;  // despawnBalls scratch, old index to new
+    std::vector<float> emitRandom;  // emitBalls scratch
+    CellSizeTuner cellTuner;
+
+    explicit Scene(uint64_t seed) : seed(seed) {
+        initializeAllCells(grid, DEFAULT_CELL_SIZE, settings.world);
+    }
+};
+
+// Drops what was derived from the old balls after they were replaced wholesale.
+void resetDerivedState(Scene &scene){
+    scene.previousPositions.clear();
+    scene.physics.contactCache.clear();
+    scene.pointer.grabbed.clear();
+    scene.handles.rebuild(scene.infoArray);
+    scene.ballsExpire = false;
+    for(const BallInfo &info : scene.infoArray){
+        scene.ballsExpire = scene.ballsExpire || info.expireStep > 0;
+    }
+    updateCellContents(scene.grid, scene.ballArray);
+    scene.physics.islands.parent.resize(scene.ballArray.size());
+    for(int i = 0; i < scene.ballArray.size(); i++){
+        scene.physics.islands.parent[i] = i;
+    }
+}
+
+int lifetimeInSteps(float seconds){
+    return seconds > 0.0f ? std::max(1, (int)std::lround(seconds / TIMESTEP)) : 0;
+}
+
+// Gives the balls appended from first on their handles and, for a lifetime in seconds above 0, an expiry step.
+void registerSpawnedBalls(Scene &scene, int first, float lifetime){
+    int lifetimeSteps = lifetimeInSteps(lifetime);
+    for(int k = first; k < scene.infoArray.size(); k++){
+        BallInfo &info = scene.infoArray[k];
+        info.slot = scene.handles.allocate(k);
+        info.generation = scene.handles.generations[info.slot];
+        info.expireStep = lifetimeSteps > 0 ? scene.stepCount + lifetimeSteps : 0;
+    }
+    scene.ballsExpire = scene.ballsExpire || (lifetimeSteps > 0 && first < scene.infoArray.size());
+}
+
+BallHandle handleOf(const Scene &scene, int index){
+    return BallHandle{scene.infoArray[index].slot, scene.infoArray[index].generation};
+}
+
+// Swap-removes the balls shouldRemove(index) picks and renumbers whatever refers to balls by index.
+template <typename Predicate>
+int despawnBalls(Scene &scene, Predicate shouldRemove){
+    int count = scene.ballArray.size();
+    std::vector<int> &newIndex = scene.despawnRemap;
+    newIndex.resize(count);
+    int removed = 0;
+    for(int i = 0; i < count; i++){
+        newIndex[i] = i;
+        if(shouldRemove(i)){
+            newIndex[i] = -1;
+            scene.handles.release(scene.infoArray[i].slot);
+            removed++;
+        }
+    }
+    if(removed == 0){
+        return 0;
+    }
+
+    bool movePrevious = scene.previousPositions.size() == count;
+    int last = count - 1;
+    for(int i = 0; i <= last; i++){
+        if(newIndex[i] >= 0){
+            continue;
+        }
+        while(last > i && newIndex[last] < 0){
+            last--;
+        }
+        if(last == i){
+            last = i - 1;
+            break;
+        }
+        scene.ballArray[i] = scene.ballArray[last];
+        scene.renderArray[i] = scene.renderArray[last];
+        scene.infoArray[i] = scene.infoArray[last];
+        if(movePrevious){
+            scene.previousPositions[i] = scene.previousPositions[last];
+        }
+        scene.handles.indices[scene.infoArray[i].slot] = i;
+        newIndex[last] = i;
+        last--;
+    }
+    int kept = count - removed;
+    scene.ballArray.resize(kept);
+    scene.renderArray.resize(kept);
+    scene.infoArray.resize(kept);
+    if(movePrevious){
+        scene.previousPositions.resize(kept);
+    }
+
+    PhysicsState &physics = scene.physics;
+    std::unordered_map<uint64_t, float> contactCache;
+    contactCache.reserve(physics.contactCache.size());
+    for(const std::pair<const uint64_t, float> &entry : physics.contactCache){
+        int a = newIndex[(int)(entry.first >> 32)];
+        int b = (int)(uint32_t)entry.first;
+        if(b >= 0){
+            b = newIndex[b];
+            if(b < 0){
+                continue;
+            }
+            if(a > b){
+                std::swap(a, b);
+            }
+        }
+        if(a >= 0){
+            contactCache[contactKey(a, b)] = entry.second;
+        }
+    }
+    physics.contactCache.swap(contactCache);
+
+    // each island is rerooted at its first surviving ball, so sleepers stay together
+    SleepIslands &islands = physics.islands;
+    if(islands.parent.size() == count){
+        std::vector<int> representative(count, -1);
+        std::vector<int> parent(kept);
+        for(int i = 0; i < count; i++){
+            if(newIndex[i] < 0){
+                continue;
+            }
+            int root = findIsland(islands, i);
+            if(representative[root] < 0){
+                representative[root] = newIndex[i];
+            }
+            parent[newIndex[i]] = representative[root];
+        }
+        islands.parent.swap(parent);
+    }
+    else{
+        islands.parent.clear();
+    }
+
+    updateCellContents(scene.grid, scene.ballArray);
+    return removed;
+}
+
+// Balls past their lifetime, and with despawnOffscreen any whose center left the world.
+void despawnExpiredBalls(Scene &scene){
+    if(!scene.ballsExpire && !scene.despawnOffscreen){
+        return;
+    }
+    despawnBalls(scene, [&](int i){
+        const Ball &ball = scene.ballArray[i];
+        int expireStep = scene.infoArray[i].expireStep;
+        Vector2 world = scene.settings.world;
+        bool offscreen = ball.position.x < 0.0f || ball.position.x > world.x || ball.position.y < 0.0f || ball.position.y > world.y;
+        return (expireStep > 0 && scene.stepCount >= expireStep) || (scene.despawnOffscreen && offscreen);
+    });
+}
+
+// Appends count balls from the emitter, growing the arrays once and drawing from the emitter's own stream.
+void emitBalls(Scene &scene, Emitter &emitter, int stream, int count){
+    int first = scene.ballArray.size();
+    size_t total = first + count;
+    if(total > scene.ballArray.capacity()){
+        size_t capacity = std::max(total, scene.ballArray.capacity() * 2);
+        scene.ballArray.reserve(capacity);
+        scene.renderArray.reserve(capacity);
+        scene.infoArray.reserve(capacity);
+    }
+    scene.ballArray.resize(total);
+    scene.renderArray.resize(total);
+    scene.infoArray.resize(total);
+
+    std::vector<float> &random = scene.emitRandom;
+    random.resize(5 * count);
+    PhiloxRandom generator(scene.seed, stream, emitter.drawn);
+    generator.fillFloats(random.data(), random.size());
+    emitter.drawn = generator.position;
+    const float *angles = random.data();
+    const float *speeds = angles + count;
+    const float *sizes = speeds + count;
+    const float *ages = sizes + count;
+    const float *tints = ages + count;
+    for(int i = 0; i < count; i++){
+        Ball &ball = scene.ballArray[first + i];
+        float angle = emitter.direction + (angles[i] * 2.0f - 1.0f) * emitter.spread;
+        float speed = Lerp(emitter.speedMin, emitter.speedMax, speeds[i]);
+        ball.velocity = Vector2{std::cos(angle) * speed, std::sin(angle) * speed};
+        // as if born at some point during the step, so a burst leaves as a stream instead of one clump
+        ball.position = Vector2Add(emitter.position, Vector2Scale(ball.velocity, ages[i] * TIMESTEP));
+        ball.radius = std::min(Lerp(emitter.radiusMin, emitter.radiusMax, sizes[i]), MAX_BALL_RADIUS);
+        float mass = ball.radius * ball.radius / 56.25f; // a radius 7.5 ball, the middle of the SPACE spawns, weighs 1
+        ball.inverse_mass = 1.0f / mass;
+        ball.sleepCounter = 0;
+
+        int palette = std::min((int)(tints[i] * 252.0f), 251);
+        Color color = {(unsigned char)(palette / 42 * 51), (unsigned char)(palette / 6 % 7 * 255 / 6), (unsigned char)(palette % 6 * 51), 255};
+        scene.renderArray[first + i] = BallRender{quantizeRadius(ball.radius), (uint8_t)palette};
+        BallInfo &info = scene.infoArray[first + i];
+        info.color = color;
+        info.mass = mass;
+        info.spawnInstance = 0;
+    }
+    registerSpawnedBalls(scene, first, emitter.lifetime);
+}
+
+void runEmitters(Scene &scene){
+    if(!scene.emittersOn){
+        return;
+    }
+    for(int k = 0; k < scene.emitters.size(); k++){
+        Emitter &emitter = scene.emitters[k];
+        emitter.owed += emitter.rate * TIMESTEP;
+        int count = (int)emitter.owed;
+        emitter.owed -= count;
+        if(count > 0){
+            emitBalls(scene, emitter, k, count);
+        }
+    }
+}
+
+// Snapshot file: this header, then the ball arrays and emitters as raw bytes; bump the version when any change.
+const char SNAPSHOT_MAGIC[8] = {'B', 'A', 'L', 'L', 'S', 'N', 'A', 'P'};
+const uint32_t SNAPSHOT_VERSION = 6;
+
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t ballCount;
+    uint64_t ballsOffset;
+    uint64_t renderOffset;
+    uint64_t infoOffset;
+    uint64_t emitterCount;
+    uint64_t emittersOffset;
+    uint64_t seed;        // emitter and spawn streams are keyed on it
+    uint64_t spawnCount;
+    int32_t spawnInstance;
+    int32_t stepCount;
+    SimulationSettings settings;
+};
+
+static_assert(std::is_trivially_copyable<Ball>::value && std::is_trivially_copyable<BallRender>::value &&
+              std::is_trivially_copyable<BallInfo>::value && std::is_trivially_copyable<SimulationSettings>::value &&
+              std::is_trivially_copyable<Emitter>::value,
+              "snapshot arrays are written and read as raw bytes");
+
+uint64_t alignSnapshotOffset(uint64_t offset){
+    return (offset + 63) / 64 * 64;
+}
+
+bool saveSceneSnapshot(const Scene &scene, const std::string &path){
+    SnapshotHeader header = {};
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.headerSize = sizeof(SnapshotHeader);
+    header.ballCount = scene.ballArray.size();
+    header.ballsOffset = alignSnapshotOffset(sizeof(SnapshotHeader));
+    header.renderOffset = alignSnapshotOffset(header.ballsOffset + header.ballCount * sizeof(Ball));
+    header.infoOffset = alignSnapshotOffset(header.renderOffset + header.ballCount * sizeof(BallRender));
+    header.emitterCount = scene.emitters.size();
+    header.emittersOffset = alignSnapshotOffset(header.infoOffset + header.ballCount * sizeof(BallInfo));
+    header.seed = scene.seed;
+    header.spawnCount = scene.spawnCount;
+    header.spawnInstance = scene.spawnInstance;
+    header.stepCount = scene.stepCount;
+    header.settings = scene.settings;
+
+    FILE *file = std::fopen(path.c_str(), "wb");
+    if(file == nullptr){
+        return false;
+    }
+    const unsigned char padding[64] = {};
+    uint64_t written = 0;
+    auto writeAt = [&](uint64_t offset, const void *data, size_t size){
+        bool ok = std::fwrite(padding, 1, offset - written, file) == offset - written && std::fwrite(data, 1, size, file) == size;
+        written = offset + size;
+        return ok;
+    };
+    bool ok = writeAt(0, &header, sizeof(header)) &&
+              writeAt(header.ballsOffset, scene.ballArray.data(), header.ballCount * sizeof(Ball)) &&
+              writeAt(header.renderOffset, scene.renderArray.data(), header.ballCount * sizeof(BallRender)) &&
+              writeAt(header.infoOffset, scene.infoArray.data(), header.ballCount * sizeof(BallInfo)) &&
+              writeAt(header.emittersOffset, scene.emitters.data(), header.emitterCount * sizeof(Emitter));
+    return std::fclose(file) == 0 && ok;
+}
+
+// Restores a scene from snapshot bytes. The arrays are copied straight out of the buffer with no parsing; the scene
+// owns its arrays, so this is one copy of every byte rather than using the buffer in place.
+bool restoreSceneSnapshot(Scene &scene, const unsigned char *data, size_t size){
+    SnapshotHeader header;
+    if(size < sizeof(header)){
+        return false;
+    }
+    std::memcpy(&header, data, sizeof(header));
+    if(std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.version != SNAPSHOT_VERSION || header.headerSize != sizeof(header)){
+        return false;
+    }
+    uint64_t count = header.ballCount;
+    if(header.ballsOffset + count * sizeof(Ball) > size || header.renderOffset + count * sizeof(BallRender) > size ||
+       header.infoOffset + count * sizeof(BallInfo) > size || header.emittersOffset + header.emitterCount * sizeof(Emitter) > size){
+        return false;
+    }
+    const Ball *balls = reinterpret_cast<const Ball *>(data + header.ballsOffset);
+    const BallRender *render = reinterpret_cast<const BallRender *>(data + header.renderOffset);
+    const BallInfo *info = reinterpret_cast<const BallInfo *>(data + header.infoOffset);
+    scene.ballArray.assign(balls, balls + count);
+    scene.renderArray.assign(render, render + count);
+    scene.infoArray.assign(info, info + count);
+    const Emitter *emitters = reinterpret_cast<const Emitter *>(data + header.emittersOffset);
+    scene.emitters.assign(emitters, emitters + header.emitterCount);
+    scene.seed = header.seed;
+    scene.spawnCount = header.spawnCount;
+    scene.spawnInstance = header.spawnInstance;
+    scene.stepCount = header.stepCount;
+    scene.settings = header.settings;
+    resetDerivedState(scene);
+    return true;
+}
+
+// Maps the file where the platform allows, so the arrays are copied from the page cache without a read buffer.
+bool loadSceneSnapshot(Scene &scene, const std::string &path){
+#ifdef __linux__
+    int fd = ::open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if(fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0){
+        if(fd >= 0){
+            ::close(fd);
+        }
+        return false;
+    }
+    void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(mapping == MAP_FAILED){
+        return false;
+    }
+    madvise(mapping, info.st_size, MADV_SEQUENTIAL);
+    bool ok = restoreSceneSnapshot(scene, static_cast<const unsigned char *>(mapping), info.st_size);
+    munmap(mapping, info.st_size);
+    return ok;
+#else
+    FILE *file = std::fopen(path.c_str(), "rb");
+    if(file == nullptr){
+        return false;
+    }
+    std::vector<unsigned char> data;
+    unsigned char buffer[1 << 16];
+    size_t received;
+    while((received = std::fread(buffer, 1, sizeof(buffer), file)) > 0){
+        data.insert(data.end(), buffer, buffer + received);
+    }
+    std::fclose(file);
+    return restoreSceneSnapshot(scene, data.data(), data.size());
+#endif
+}
+
+// Moves the rewind cursor by steps frames and puts the recorded state there into the scene.
+void scrubRewind(Scene &scene, int steps){
+    RewindBuffer &rewind = scene.rewind;
+    if(rewind.frames.empty()){
+        return;
+    }
+    if(rewind.cursorIndex < 0){
+        rewind.cursor = rewind.last;
+        rewind.cursorIndex = rewind.frames.size() - 1;
+    }
+    rewind.seek(rewind.cursorIndex + steps);
+    const RewindState &state = rewind.cursor;
+    scene.ballArray = state.balls;
+    scene.renderArray = state.render;
+    scene.infoArray = state.info;
+    scene.stepCount = state.stepCount;
+    scene.spawnInstance = state.spawnInstance;
+    scene.spawnCount = state.spawnCount;
+    scene.settings = state.settings;
+    scene.emitters = state.emitters;
+    resetDerivedState(scene);
+    scene.scrubbed = true;
+}
+
+// Entering pauses on the newest step; leaving resumes from the scrubbed step and drops the history after it.
+void toggleRewind(Scene &scene){
+    RewindBuffer &rewind = scene.rewind;
+    if(!scene.rewinding){
+        scene.rewinding = rewind.capacity > 0;
+        scene.scrubbed = false;
+        rewind.cursorIndex = -1;
+        return;
+    }
+    if(scene.scrubbed){
+        rewind.truncateAfterCursor();
+    }
+    rewind.cursorIndex = -1;
+    scene.rewinding = false;
+}
+
+// Input from the window, applied by the simulation between steps.
+enum SceneCommand
+{
+    COMMAND_SPAWN,
+    COMMAND_CYCLE_SOLVER,
+    COMMAND_TOGGLE_NBODY,
+    COMMAND_TOGGLE_FLUID,
+    COMMAND_TOGGLE_GRAVITY,
+    COMMAND_SAVE_SNAPSHOT,
+    COMMAND_LOAD_SNAPSHOT,
+    COMMAND_TOGGLE_REWIND,
+    COMMAND_REWIND_BACK,
+    COMMAND_REWIND_FORWARD,
+    COMMAND_TOGGLE_EMITTERS
+};
+
+void applySceneCommand(Scene &scene, SceneCommand command){
+    SimulationSettings &settings = scene.settings;
+    int first = scene.ballArray.size();
+    Vector2 world = settings.world; // the mode presets below keep the current world
+    Vector2 spawnPoint = Vector2Scale(world, 0.5f);
+    switch(command){
+    case COMMAND_SPAWN:
+        if (scene.spawnInstance == 10)
+        {
+            InitializeBall(scene.ballArray, scene.renderArray, scene.infoArray, 1, true, scene.spawnInstance, spawnPoint, scene.seed, SPAWN_STREAM_BASE + scene.spawnCount++);
+            scene.spawnInstance = 0;
+        }
+        else
+        {
+            InitializeBall(scene.ballArray, scene.renderArray, scene.infoArray, 25, false, scene.spawnInstance, spawnPoint, scene.seed, SPAWN_STREAM_BASE + scene.spawnCount++);
+            scene.spawnInstance++;
+        }
+        registerSpawnedBalls(scene, first, scene.ballLifetime);
+        break;
+    case COMMAND_CYCLE_SOLVER:
+        settings.solver = (SolverMode)((settings.solver + 1) % SOLVER_MODE_COUNT);
+        scene.physics.contactCache.clear();
+        break;
+    case COMMAND_TOGGLE_NBODY:
+        settings.nBodyGravity = !settings.nBodyGravity;
+        break;
+    case COMMAND_TOGGLE_FLUID:
+        settings = settings.fluid ? SimulationSettings() : fluidModeSettings();
+        settings.world = world;
+        break;
+    case COMMAND_TOGGLE_GRAVITY:
+        settings = settings.gravityEnabled ? SimulationSettings() : gravityModeSettings();
+        settings.world = world;
+        for(int i = 0; i < scene.ballArray.size(); i++){
+            scene.ballArray[i].sleepCounter = 0;
+        }
+        break;
+    case COMMAND_SAVE_SNAPSHOT:
+        if(!saveSceneSnapshot(scene, scene.snapshotPath)){
+            std::cout << "Could not save " << scene.snapshotPath << std::endl;
+        }
+        break;
+    case COMMAND_LOAD_SNAPSHOT:
+        if(!loadSceneSnapshot(scene, scene.snapshotPath)){
+            std::cout << "Could not load " << scene.snapshotPath << std::endl;
+        }
+        break;
+    case COMMAND_TOGGLE_REWIND:
+        toggleRewind(scene);
+        break;
+    case COMMAND_TOGGLE_EMITTERS:
+        scene.emittersOn = !scene.emittersOn;
+        break;
+    case COMMAND_REWIND_BACK:
+    case COMMAND_REWIND_FORWARD:
+        if(scene.rewinding){
+            scrubRewind(scene, command == COMMAND_REWIND_BACK ? -1 : 1);
+        }
+        break;
+    }
+}
+
+// Works from the grid as the last step left it, so balls spawned since are not picked up until the next step.
+void applyPointerTool(Scene &scene){
+    PointerState &pointer = scene.pointer;
+    const PointerInput &input = pointer.input;
+    std::vector<Ball> &ballArray = scene.ballArray;
+    bool pressed = input.held && !pointer.wasHeld;
+    pointer.wasHeld = input.held;
+    pointer.touched = 0;
+    if(!input.held || input.tool != TOOL_DRAG){
+        pointer.grabbed.clear();
+    }
+    if(!input.held){
+        return;
+    }
+
+    if(input.tool == TOOL_DRAG){
+        if(pressed){
+            queryRadius(scene.grid, ballArray, input.position, input.radius, pointer.found);
+            pointer.grabbed.resize(pointer.found.size());
+            pointer.grabOffsets.resize(pointer.found.size());
+            for(int n = 0; n < pointer.found.size(); n++){
+                pointer.grabbed[n] = handleOf(scene, pointer.found[n]);
+                pointer.grabOffsets[n] = Vector2Subtract(ballArray[pointer.found[n]].position, input.position);
+            }
+        }
+        for(int n = 0; n < pointer.grabbed.size(); n++){
+            int k = scene.handles.resolve(pointer.grabbed[n]);
+            if(k < 0){
+                continue;
+            }
+            pointer.touched++;
+            Ball &ball = ballArray[k];
+            Vector2 target = Vector2Add(input.position, pointer.grabOffsets[n]);
+            ball.velocity = Vector2Scale(Vector2Subtract(target, ball.position), DRAG_STIFFNESS / TIMESTEP);
+            ball.sleepCounter = 0;
+        }
+        return;
+    }
+
+    if(input.tool == TOOL_ERASE){
+        queryRadius(scene.grid, ballArray, input.position, input.radius, pointer.found);
+        pointer.touched = 0;
+        if(pointer.found.empty()){
+            return;
+        }
+        pointer.erasing.assign(ballArray.size(), false);
+        for(int k : pointer.found){
+            pointer.erasing[k] = true;
+        }
+        pointer.touched = despawnBalls(scene, [&](int i){ return pointer.erasing[i]; });
+        return;
+    }
+
+    float direction = input.tool == TOOL_PUSH ? 1.0f : -1.0f;
+    queryRadius(scene.grid, ballArray, input.position, input.radius, pointer.found);
+    for(int k : pointer.found){
+        Ball &ball = ballArray[k];
+        Vector2 offset = Vector2Subtract(ball.position, input.position);
+        float distance = Vector2Length(offset);
+        if(distance < 0.001f){
+            continue;
+        }
+        float falloff = 1.0f - std::min(1.0f, distance / input.radius);
+        ball.velocity = Vector2Add(ball.velocity, Vector2Scale(offset, direction * BRUSH_STRENGTH * falloff * TIMESTEP / distance));
+        ball.sleepCounter = 0;
+    }
+    pointer.touched = pointer.found.size();
+}
+
+// Seconds for one grid fill and pair (or fluid neighbour) pass; found keeps the work from being optimized away.
+double timeGridPass(Grid &grid, std::vector<Ball> &ballArray, const SimulationSettings &settings, std::vector<int> &neighbourCounts, int &found){
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    updateCellContents(grid, ballArray);
+    found = 0;
+    if(settings.fluid){
+        neighbourCounts.assign(ballArray.size(), 0);
+        forEachNeighbour(grid, ballArray, settings.fluidSmoothingLength, [&](int i, int j, Vector2 delta, float distanceSq){
+            neighbourCounts[i]++;
+        });
+        for(int count : neighbourCounts){
+            found += count;
+        }
+    }
+    else{
+        forEachNearbyPair(grid, [&](int a, int b){
+            float reach = ballArray[a].radius + ballArray[b].radius;
+            found += Vector2DistanceSqr(ballArray[a].position, ballArray[b].position) <= reach * reach;
+        });
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Moves the right and bottom walls and wakes every ball; the walls push back any left outside.
+void resizeWorld(Scene &scene, Vector2 size){
+    size.x = std::max(size.x, 2.0f * MAX_BALL_RADIUS);
+    size.y = std::max(size.y, 2.0f * MAX_BALL_RADIUS);
+    scene.settings.world = size;
+    for(Ball &ball : scene.ballArray){
+        ball.sleepCounter = 0;
+    }
+    if(fitGridToWorld(scene.grid, size)){
+        updateCellContents(scene.grid, scene.ballArray);
+    }
+}
+
+void switchCellSize(Scene &scene, float cellSize){
+    initializeAllCells(scene.grid, cellSize, scene.settings.world);
+    updateCellContents(scene.grid, scene.ballArray); // continuous collision reads last step's contents
+}
+
+// Farthest apart two ball centres can be and still make a pair: touching plus the contact margin, and under XPBD,
+// which finds its pairs before moving, also how far the two can close within the step.
+float pairReach(float maxRadius, float maxSpeed, const SimulationSettings &settings){
+    float reach = 2.0f * maxRadius + CONTACT_MARGIN;
+    return settings.solver == SOLVER_XPBD ? reach + 2.0f * maxSpeed * TIMESTEP : reach;
+}
+
+void tuneCellSize(Scene &scene){
+    Grid &grid = scene.grid;
+    std::vector<Ball> &ballArray = scene.ballArray;
+    CellSizeTuner &tuner = scene.cellTuner;
+
+    // pairs are only looked for in neighbouring cells, so a grid narrower than the pair reach has to grow, tuned or not
+    float maxRadius = 0.0f;
+    float maxSpeedSq = 0.0f;
+    if(grid.cellSize < 2.0f * MAX_BALL_RADIUS + CONTACT_MARGIN || scene.settings.solver == SOLVER_XPBD || (tuner.enabled && scene.stepCount >= tuner.nextStep)){
+        for(const Ball &ball : ballArray){
+            maxRadius = std::max(maxRadius, ball.radius);
+            maxSpeedSq = std::max(maxSpeedSq, Vector2LengthSqr(ball.velocity));
+        }
+    }
+    float minimum = std::max(std::ceil(pairReach(maxRadius, std::sqrt(maxSpeedSq), scene.settings)), 4.0f);
+    if(grid.cellSize < minimum){
+        switchCellSize(scene, minimum);
+        std::snprintf(tuner.decision, sizeof(tuner.decision), "cell %.0f  grown for r %.1f", minimum, maxRadius);
+    }
+    if(!tuner.enabled || scene.stepCount < tuner.nextStep){
+        return;
+    }
+    tuner.nextStep = scene.stepCount + tuner.interval;
+    if(ballArray.size() < 2){
+        return;
+    }
+
+    Vector2 world = scene.settings.world;
+    float largest = std::min(world.x, world.y) / 2.0f;
+    float spacing = std::sqrt(world.x * world.y / ballArray.size());
+    float candidates[] = {minimum, minimum * 1.5f, minimum * 2.0f, minimum * 3.0f, spacing * 2.0f};
+    std::vector<float> sizes = {grid.cellSize}; // the current size first, as the one to beat
+    for(float candidate : candidates){
+        float size = std::round(Clamp(candidate, minimum, std::max(minimum, largest)));
+        if(std::find(sizes.begin(), sizes.end(), size) == sizes.end()){
+            sizes.push_back(size);
+        }
+    }
+
+    float best = grid.cellSize;
+    double currentTime = 0.0;
+    double bestTime = INFINITY;
+    for(float size : sizes){
+        initializeAllCells(tuner.scratch, size, scene.settings.world);
+        double time = INFINITY;
+        for(int r = 0; r < tuner.repeats; r++){
+            int found = 0;
+            time = std::min(time, timeGridPass(tuner.scratch, ballArray, scene.settings, tuner.neighbourCounts, found));
+        }
+        if(size == grid.cellSize){
+            currentTime = time;
+        }
+        if(time < bestTime){
+            bestTime = time;
+            best = size;
+        }
+    }
+
+    if(best != grid.cellSize && bestTime < tuner.margin * currentTime){
+        std::snprintf(tuner.decision, sizeof(tuner.decision), "cell %.0f -> %.0f  %.2f vs %.2f ms", grid.cellSize, best, bestTime * 1000.0, currentTime * 1000.0);
+        switchCellSize(scene, best);
+    }
+    else{
+        std::snprintf(tuner.decision, sizeof(tuner.decision), "cell %.0f kept  %.2f ms", grid.cellSize, currentTime * 1000.0);
+    }
+}
+
+void stepScene(Scene &scene){
+    if(scene.rewinding){
+        return;
+    }
+    applyPointerTool(scene);
+    runEmitters(scene);
+    scene.previousPositions.resize(scene.ballArray.size());
+    for (int i = 0; i < scene.ballArray.size(); i++)
+    {
+        scene.previousPositions[i] = scene.ballArray[i].position;
+    }
+    if(scene.physics.events){
+        scene.physics.events->step = scene.stepCount + 1;
+    }
+    // settings restored from a snapshot or the rewind history may bring another world with them
+    if(fitGridToWorld(scene.grid, scene.settings.world)){
+        updateCellContents(scene.grid, scene.ballArray);
+    }
+    tuneCellSize(scene);
+    checkCollisionInCell(scene.grid, scene.settings, scene.ballArray, scene.physics);
+    scene.stepCount++;
+    despawnExpiredBalls(scene);
+    scene.rewind.record(scene.ballArray, scene.renderArray, scene.infoArray, scene.stepCount, scene.spawnInstance, scene.spawnCount, scene.settings, scene.emitters);
+}
+
+// Commands queued by the window thread; the lock is only held to append or to swap the list out.
+struct CommandQueue
+{
+    std::mutex mutex;
+    std::vector<SceneCommand> pending;
+    PointerInput pointer;
+    Vector2 world = {0.0f, 0.0f}; // resize waiting for the simulation, 0 for none
+
+    void push(SceneCommand command){
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(command);
+    }
+
+    void take(std::vector<SceneCommand> &commands){
+        commands.clear();
+        std::lock_guard<std::mutex> lock(mutex);
+        commands.swap(pending);
+    }
+
+    void setPointer(const PointerInput &input){
+        std::lock_guard<std::mutex> lock(mutex);
+        pointer = input;
+    }
+
+    PointerInput latestPointer(){
+        std::lock_guard<std::mutex> lock(mutex);
+        return pointer;
+    }
+
+    void setWorld(Vector2 size){
+        std::lock_guard<std::mutex> lock(mutex);
+        world = size;
+    }
+
+    // The world size asked for since the last call, if any
+    bool takeWorld(Vector2 &size){
+        std::lock_guard<std::mutex> lock(mutex);
+        if(world.x <= 0.0f){
+            return false;
+        }
+        size = world;
+        world = Vector2Zero();
+        return true;
+    }
+};
+
+struct CellSnapshot
+{
+    Vector2 position;
+    Color color;
+    int ballCount;
+};
+
+// What the renderer needs from one step. Positions of balls spawned during the step have no previous entry.
+struct RenderSnapshot
+{
+    std::vector<Vector2> previousPositions;
+    std::vector<Vector2> positions;
+    std::vector<float> radii;
+    std::vector<BallRender> render;
+    std::vector<Color> colors;
+    std::vector<CellSnapshot> cells; // row-major
+    int gridColumns = 0;
+    float cellSize = DEFAULT_CELL_SIZE;
+    std::string cellTuning; // the cell size tuner's last decision
+    Vector2 world = {WINDOW_WIDTH, WINDOW_HEIGHT};
+    int stepCount = 0;
+    int pointerTouched = 0; // balls under the mouse tool
+    std::string status; // shown under the ball count
+    std::chrono::steady_clock::time_point publishTime;
+};
+
+// Lock-free triple buffer between one writer and one reader.
+struct SnapshotBuffer
+{
+    static const int FRESH = 4; // set in middle when it holds a snapshot the reader has not taken yet
+    RenderSnapshot slots[3];
+    std::atomic<int> middle{1};
+    int back = 0;  // writer's slot
+    int front = 2; // reader's slot
+
+    RenderSnapshot &writeSlot(){
+        return slots[back];
+    }
+
+    void publish(){
+        back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & ~FRESH;
+    }
+
+    // The newest published snapshot, or the one returned last time if nothing new has arrived.
+    const RenderSnapshot &latest(){
+        if(middle.load(std::memory_order_relaxed) & FRESH){
+            front = middle.exchange(front, std::memory_order_acq_rel) & ~FRESH;
+        }
+        return slots[front];
+    }
+};
+
+void publishSnapshot(const Scene &scene, SnapshotBuffer &buffer){
+    RenderSnapshot &snapshot = buffer.writeSlot();
+    int count = scene.ballArray.size();
+    snapshot.previousPositions.assign(scene.previousPositions.begin(), scene.previousPositions.end());
+    snapshot.positions.resize(count);
+    snapshot.radii.resize(count);
+    snapshot.colors.resize(count);
+    for(int i = 0; i < count; i++){
+        snapshot.positions[i] = scene.ballArray[i].position;
+        snapshot.radii[i] = scene.ballArray[i].radius;
+        snapshot.colors[i] = scene.infoArray[i].color;
+    }
+    snapshot.render.assign(scene.renderArray.begin(), scene.renderArray.end());
+    snapshot.cells.clear();
+    for(int i = 0; i < scene.grid.size(); i++){
+        for(int j = 0; j < scene.grid[i].size(); j++){
+            const cell &gridCell = scene.grid[i][j];
+            snapshot.cells.push_back(CellSnapshot{gridCell.position, gridCell.color, (int)gridCell.ballsInCell.size()});
+        }
+    }
+    snapshot.gridColumns = scene.grid.columns;
+    snapshot.cellSize = scene.grid.cellSize;
+    snapshot.world = scene.settings.world;
+    snapshot.cellTuning = scene.cellTuner.decision;
+    snapshot.stepCount = scene.stepCount;
+    snapshot.pointerTouched = scene.pointer.touched;
+    snapshot.status.clear();
+    if(scene.rewinding){
+        const RewindBuffer &rewind = scene.rewind;
+        int newest = rewind.frames.empty() ? scene.stepCount : rewind.frames.back().stepCount;
+        char status[128]; // not TextFormat, whose buffers belong to the window thread
+        std::snprintf(status, sizeof(status), "REWIND %.2fs  history %d steps, %.1f KB (%.1fx smaller than raw)", (newest - scene.stepCount) * -TIMESTEP,
+                      (int)rewind.frames.size(), rewind.compressedBytes / 1024.0f, rewind.rawBytes / std::max(1.0f, (float)rewind.compressedBytes));
+        snapshot.status = status;
+    }
+    snapshot.publishTime = std::chrono::steady_clock::now();
+    buffer.publish();
+}
+
+#ifdef __linux__
+const uint32_t SHARED_STATE_MAGIC = 0x4C4C4142; // "BALL"
+const uint32_t SHARED_STATE_VERSION = 1;
+const int SHARED_STATE_FRAMES = 4;
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared state counters must be lock-free");
+
+// Shared memory layout: this header, then SHARED_STATE_FRAMES frames of frameSize bytes.
+struct SharedStateHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t frameCount;
+    uint32_t capacity;
+    uint64_t frameSize;
+    std::atomic<uint64_t> published; // frames written so far; the newest is in slot (published - 1) % frameCount
+    std::atomic<uint32_t> closed;    // set when the publisher exits
+};
+
+// Seqlock: sequence is odd while the frame is being written.
+struct SharedFrameHeader
+{
+    std::atomic<uint64_t> sequence;
+    uint64_t step;
+    uint32_t ballCount;
+    uint32_t padding;
+};
+
+size_t sharedFrameSize(uint32_t capacity){
+    size_t size = sizeof(SharedFrameHeader) + capacity * (2 * sizeof(Vector2) + sizeof(float));
+    return (size + 63) / 64 * 64;
+}
+
+// Publishes up to capacity balls into a POSIX shared memory ring for other processes.
+struct SharedStatePublisher
+{
+    std::string name;
+    unsigned char *base = nullptr;
+    size_t size = 0;
+    uint64_t published = 0;
+
+    bool open(const std::string &objectName, uint32_t capacity){
+        int fd = shm_open(objectName.c_str(), O_CREAT | O_RDWR, 0644);
+        if(fd < 0){
+            return false;
+        }
+        size_t frameSize = sharedFrameSize(capacity);
+        size_t totalSize = sizeof(SharedStateHeader) + SHARED_STATE_FRAMES * frameSize;
+        void *mapping = MAP_FAILED;
+        if(ftruncate(fd, totalSize) == 0){
+            mapping = mmap(nullptr, totalSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if(mapping == MAP_FAILED){
+            shm_unlink(objectName.c_str());
+            return false;
+        }
+        name = objectName;
+        base = static_cast<unsigned char *>(mapping);
+        size = totalSize;
+        std::memset(base, 0, size);
+        SharedStateHeader *header = new (base) SharedStateHeader;
+        header->version = SHARED_STATE_VERSION;
+        header->frameCount = SHARED_STATE_FRAMES;
+        header->capacity = capacity;
+        header->frameSize = frameSize;
+        header->published.store(0);
+        header->closed.store(0);
+        for(int f = 0; f < SHARED_STATE_FRAMES; f++){
+            new (frame(f)) SharedFrameHeader;
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        header->magic = SHARED_STATE_MAGIC; // readers wait for this before trusting the rest
+        return true;
+    }
+
+    SharedStateHeader *header() const {
+        return reinterpret_cast<SharedStateHeader *>(base);
+    }
+
+    SharedFrameHeader *frame(int slot) const {
+        return reinterpret_cast<SharedFrameHeader *>(base + sizeof(SharedStateHeader) + slot * header()->frameSize);
+    }
+
+    void publish(const Scene &scene){
+        if(base == nullptr){
+            return;
+        }
+        SharedStateHeader *shared = header();
+        uint32_t capacity = shared->capacity;
+        SharedFrameHeader *target = frame(published % SHARED_STATE_FRAMES);
+        uint32_t count = std::min<size_t>(scene.ballArray.size(), capacity);
+        Vector2 *positions = reinterpret_cast<Vector2 *>(target + 1);
+        Vector2 *velocities = positions + capacity;
+        float *radii = reinterpret_cast<float *>(velocities + capacity);
+
+        uint64_t sequence = target->sequence.load(std::memory_order_relaxed);
+        target->sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        target->step = scene.stepCount;
+        target->ballCount = count;
+        for(uint32_t i = 0; i < count; i++){
+            const Ball &ball = scene.ballArray[i];
+            positions[i] = ball.position;
+            velocities[i] = ball.velocity;
+            radii[i] = ball.radius;
+        }
+        target->sequence.store(sequence + 2, std::memory_order_release);
+        shared->published.store(++published, std::memory_order_release);
+    }
+
+    void close(){
+        if(base == nullptr){
+            return;
+        }
+        header()->closed.store(1, std::memory_order_release);
+        munmap(base, size);
+        shm_unlink(name.c_str());
+        base = nullptr;
+    }
+
+    ~SharedStatePublisher(){
+        close();
+    }
+};
+
+// Prints a summary of a publisher's newest frame twice a second until it closes.
+void runSharedStateReader(const std::string &objectName){
+    int fd = shm_open(objectName.c_str(), O_RDONLY, 0);
+    struct stat info;
+    if(fd < 0 || fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(SharedStateHeader)){
+        std::cout << "No shared state published as " << objectName << std::endl;
+        if(fd >= 0){
+            close(fd);
+        }
+        return;
+    }
+    void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(mapping == MAP_FAILED){
+        std::cout << "Could not map " << objectName << std::endl;
+        return;
+    }
+    const unsigned char *base = static_cast<const unsigned char *>(mapping);
+    const SharedStateHeader *header = reinterpret_cast<const SharedStateHeader *>(base);
+    while(header->magic != SHARED_STATE_MAGIC){
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if(header->version != SHARED_STATE_VERSION){
+        std::cout << objectName << " has layout version " << header->version << ", expected " << SHARED_STATE_VERSION << std::endl;
+        munmap(mapping, info.st_size);
+        return;
+    }
+
+    uint64_t retries = 0;
+    while(!header->closed.load(std::memory_order_acquire)){
+        uint64_t published = header->published.load(std::memory_order_acquire);
+        if(published == 0){
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
+        const SharedFrameHeader *frame = reinterpret_cast<const SharedFrameHeader *>(base + sizeof(SharedStateHeader) + (published - 1) % header->frameCount * header->frameSize);
+        const Vector2 *velocities = reinterpret_cast<const Vector2 *>(frame + 1) + header->capacity;
+
+        // reads straight from the mapping and throws the result away if the writer got there in the meantime
+        uint64_t sequence = frame->sequence.load(std::memory_order_acquire);
+        if(sequence % 2 == 1){
+            retries++;
+            continue;
+        }
+        uint64_t step = frame->step;
+        uint32_t count = std::min(frame->ballCount, header->capacity);
+        float speedSum = 0.0f;
+        for(uint32_t i = 0; i < count; i++){
+            speedSum += Vector2Length(velocities[i]);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(frame->sequence.load(std::memory_order_relaxed) != sequence){
+            retries++;
+            continue;
+        }
+        std::cout << "step " << step << " balls " << count << " mean speed " << (count > 0 ? speedSum / count : 0.0f) << " retries " << retries << std::endl;
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    }
+    munmap(mapping, info.st_size);
+}
+#else
+struct SharedStatePublisher
+{
+    bool open(const std::string &objectName, uint32_t capacity){
+        return false;
+    }
+
+    void publish(const Scene &scene){}
+};
+
+void runSharedStateReader(const std::string &objectName){
+    std::cout << "Shared memory state needs POSIX shared memory, which this platform does not provide" << std::endl;
+}
+#endif
+
+// Shared between the window and the simulation thread.
+struct SimulationControl
+{
+    std::atomic<bool> stop{false};
+    std::atomic<int> stepsPerTick{1}; // more than one fast-forwards; only the last step of each tick is published
+};
+
+// Steps the scene at the physics rate until stopped, publishing once per tick; a backlog is dropped, not caught up.
+void runSimulation(Scene &scene, CommandQueue &commands, SnapshotBuffer &snapshots, SharedStatePublisher &sharedState, SimulationControl &control, int maxSteps){
+    typedef std::chrono::steady_clock Clock;
+    Clock::duration step = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(TIMESTEP));
+    Clock::time_point nextStep = Clock::now();
+    std::vector<SceneCommand> received;
+    while(!control.stop.load(std::memory_order_relaxed) && (maxSteps <= 0 || scene.stepCount < maxSteps)){
+        commands.take(received);
+        for(SceneCommand command : received){
+            applySceneCommand(scene, command);
+        }
+        scene.pointer.input = commands.latestPointer();
+        Vector2 world;
+        if(commands.takeWorld(world)){
+            resizeWorld(scene, world);
+        }
+        int steps = control.stepsPerTick.load(std::memory_order_relaxed);
+        for(int i = 0; i < steps && (maxSteps <= 0 || scene.stepCount < maxSteps); i++){
+            stepScene(scene);
+        }
+        publishSnapshot(scene, snapshots);
+        sharedState.publish(scene);
+
+        nextStep += step;
+        Clock::time_point now = Clock::now();
+        if(now - nextStep > std::chrono::milliseconds(250)){
+            nextStep = now;
+        }
+        std::this_thread::sleep_until(nextStep);
+    }
+}
+
+struct BatchStats
+{
+    int balls = 0;
+    int sleeping = 0;
+    float meanSpeed = 0.0f;
+    float maxSpeed = 0.0f;
+    float kineticEnergy = 0.0f;
+    float maxOverlap = 0.0f;
+    double milliseconds = 0.0;
+};
+
+BatchStats summarizeScene(Scene &scene){
+    BatchStats stats;
+    std::vector<Ball> &ballArray = scene.ballArray;
+    stats.balls = ballArray.size();
+    for(const Ball &ball : ballArray){
+        float speed = Vector2Length(ball.velocity);
+        stats.meanSpeed += speed;
+        stats.maxSpeed = std::max(stats.maxSpeed, speed);
+        stats.kineticEnergy += 0.5f * speed * speed / ball.inverse_mass;
+        if(isAsleep(ball, scene.settings)){
+            stats.sleeping++;
+        }
+    }
+    if(stats.balls > 0){
+        stats.meanSpeed /= stats.balls;
+    }
+    updateCellContents(scene.grid, ballArray);
+    forEachNearbyPair(scene.grid, [&](int a, int b){
+        float overlap = ballArray[a].radius + ballArray[b].radius - getDistance(ballArray[a], ballArray[b]);
+        stats.maxOverlap = std::max(stats.maxOverlap, overlap);
+    });
+    return stats;
+}
+
+struct BatchOptions
+{
+    int scenes = 0;
+    int steps = 600;
+    int spawnsMin = 10;        // spawn count and elasticity are spread evenly from min to max over the scenes
+    int spawnsMax = 10;
+    float elasticityMin = 1.0f;
+    float elasticityMax = 1.0f;
+};
+
+// Runs independent scenes headlessly, one per worker at a time, and prints a CSV line of statistics per scene.
+void runBatch(const BatchOptions &batch, const SimulationSettings &baseSettings, const StaticGeometry &level, uint64_t seed){
+    const int stepsBetweenSpawns = 30;
+    std::vector<Scene> scenes;
+    std::vector<int> spawns(batch.scenes);
+    std::vector<BatchStats> stats(batch.scenes);
+    scenes.reserve(batch.scenes);
+    for(int k = 0; k < batch.scenes; k++){
+        float t = batch.scenes > 1 ? (float)k / (batch.scenes - 1) : 0.0f;
+        scenes.emplace_back(seed + k);
+        scenes[k].settings = baseSettings;
+        scenes[k].physics.obstacles = level;
+        scenes[k].settings.elasticityCoefficient = Lerp(batch.elasticityMin, batch.elasticityMax, t);
+        spawns[k] = (int)std::round(Lerp((float)batch.spawnsMin, (float)batch.spawnsMax, t));
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::atomic<int> nextScene(0);
+    workerPool().parallelFor(workerPool().size(), [&](int begin, int end){
+        for(int k = nextScene++; k < batch.scenes; k = nextScene++){
+            std::chrono::steady_clock::time_point sceneStart = std::chrono::steady_clock::now();
+            Scene &scene = scenes[k];
+            for(int step = 0; step < batch.steps; step++){
+                if(step % stepsBetweenSpawns == 0 && step / stepsBetweenSpawns < spawns[k]){
+                    applySceneCommand(scene, COMMAND_SPAWN);
+                }
+                stepScene(scene);
+            }
+            stats[k] = summarizeScene(scene);
+            stats[k].milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - sceneStart).count();
+        }
+    });
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "scene,seed,elasticity,spawns,balls,sleeping,meanSpeed,maxSpeed,kineticEnergy,maxOverlap,ms" << std::endl;
+    for(int k = 0; k < batch.scenes; k++){
+        const BatchStats &s = stats[k];
+        std::cout << k << "," << seed + k << "," << scenes[k].settings.elasticityCoefficient << "," << spawns[k] << ","
+                  << s.balls << "," << s.sleeping << "," << s.meanSpeed << "," << s.maxSpeed << "," << s.kineticEnergy << ","
+                  << s.maxOverlap << "," << s.milliseconds << std::endl;
+    }
+    std::cout << "# " << batch.scenes << " scenes x " << batch.steps << " steps in " << seconds << " s, "
+              << batch.scenes * batch.steps / std::max(seconds, 1e-9) << " scene steps/s on " << workerPool().size() << " threads" << std::endl;
+}
+
+struct DomainOptions
+{
+    int processes = 0;
+    int steps = 600;
+    int spawns = 10;
+    float cellSize = DEFAULT_CELL_SIZE; // grid cell size of every strip, which also sets where the strips are cut
+};
+
+#ifdef __linux__
+// A ball moving to a neighbouring strip, with everything its new owner has to store for it.
+struct MigratingBall
+{
+    Ball ball;
+    BallRender render;
+    BallInfo info;
+};
+
+bool writeAll(int fd, const void *data, size_t size){
+    const char *bytes = static_cast<const char *>(data);
+    while(size > 0){
+        ssize_t written = write(fd, bytes, size);
+        if(written <= 0){
+            return false;
+        }
+        bytes += written;
+        size -= written;
+    }
+    return true;
+}
+
+bool readAll(int fd, void *data, size_t size){
+    char *bytes = static_cast<char *>(data);
+    while(size > 0){
+        ssize_t received = read(fd, bytes, size);
+        if(received <= 0){
+            return false;
+        }
+        bytes += received;
+        size -= received;
+    }
+    return true;
+}
+
+// One end of the socket to a neighbouring strip; the lower rank sends first so neither side blocks in write.
+struct DomainLink
+{
+    int fd = -1;
+    bool sendsFirst = false;
+
+    template <typename T>
+    bool exchange(const std::vector<T> &outgoing, std::vector<T> &incoming) const {
+        if(fd < 0){
+            incoming.clear();
+            return true;
+        }
+        if(sendsFirst){
+            return send(outgoing) && receive(incoming);
+        }
+        return receive(incoming) && send(outgoing);
+    }
+
+    template <typename T>
+    bool send(const std::vector<T> &items) const {
+        uint32_t count = items.size();
+        return writeAll(fd, &count, sizeof(count)) && writeAll(fd, items.data(), count * sizeof(T));
+    }
+
+    template <typename T>
+    bool receive(std::vector<T> &items) const {
+        uint32_t count = 0;
+        if(!readAll(fd, &count, sizeof(count))){
+            return false;
+        }
+        items.resize(count);
+        return readAll(fd, items.data(), count * sizeof(T));
+    }
+};
+
+// Exchanges with both neighbours, even ranks right first and odd ranks left first, so the chain never deadlocks.
+template <typename T>
+bool exchangeWithNeighbours(int rank, const DomainLink &left, const DomainLink &right,
+                            const std::vector<T> &toLeft, const std::vector<T> &toRight, std::vector<T> &fromLeft, std::vector<T> &fromRight){
+    if(rank % 2 == 0){
+        return right.exchange(toRight, fromRight) && left.exchange(toLeft, fromLeft);
+    }
+    return left.exchange(toLeft, fromLeft) && right.exchange(toRight, fromRight);
+}
+
+struct DomainStats
+{
+    int balls = 0;
+    int ghosts = 0;   // halo copies received on the last step
+    int migrated = 0; // balls handed to a neighbour over the whole run
+    float kineticEnergy = 0.0f;
+    double milliseconds = 0.0;
+};
+
+// Farthest from a strip edge a ball can be and still meet a ball across it this step, given the largest radius and
+// speed on both sides: touching plus the contact margin, or the fluid kernel radius, plus how far the two can close.
+float domainHalo(const SimulationSettings &settings, const std::vector<float> &own, const std::vector<float> &neighbour){
+    if(neighbour.size() < 2){
+        return 0.0f;
+    }
+    float reach = std::max(own[0] + neighbour[0] + CONTACT_MARGIN, settings.fluid ? settings.fluidSmoothingLength : 0.0f);
+    return reach + (own[1] + neighbour[1]) * TIMESTEP;
+}
+
+// Simulates the strip [left, right) of the world; balls near an edge visit the neighbour as ghosts for each step.
+DomainStats runDomain(int rank, float left, float right, const DomainLink &leftLink, const DomainLink &rightLink,
+                      const DomainOptions &domain, const SimulationSettings &settings, uint64_t seed){
+    const int stepsBetweenSpawns = 30;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    Scene scene(seed);
+    scene.settings = settings;
+    initializeAllCells(scene.grid, domain.cellSize, settings.world);
+    SleepIslands &islands = scene.physics.islands;
+    bool ownsSpawnPoint = left <= settings.world.x / 2 && settings.world.x / 2 < right;
+    std::vector<float> extent(2), extentFromLeft, extentFromRight; // largest radius and speed in a strip
+    std::vector<Ball> ghostsToLeft, ghostsToRight, ghostsFromLeft, ghostsFromRight;
+    std::vector<MigratingBall> toLeft, toRight, fromLeft, fromRight;
+    std::vector<bool> ghostSlots;
+    DomainStats stats;
+
+    for(int step = 0; step < domain.steps; step++){
+        if(ownsSpawnPoint && step % stepsBetweenSpawns == 0 && step / stepsBetweenSpawns < domain.spawns){
+            applySceneCommand(scene, COMMAND_SPAWN);
+        }
+
+        extent[0] = 0.0f;
+        extent[1] = 0.0f;
+        for(const Ball &ball : scene.ballArray){
+            extent[0] = std::max(extent[0], ball.radius);
+            extent[1] = std::max(extent[1], Vector2Length(ball.velocity));
+        }
+        if(!exchangeWithNeighbours(rank, leftLink, rightLink, extent, extent, extentFromLeft, extentFromRight)){
+            std::cout << "Domain " << rank << ": lost connection to a neighbour" << std::endl;
+            break;
+        }
+        float leftHalo = domainHalo(settings, extent, extentFromLeft);
+        float rightHalo = domainHalo(settings, extent, extentFromRight);
+        ghostsToLeft.clear();
+        ghostsToRight.clear();
+        for(const Ball &ball : scene.ballArray){
+            if(ball.position.x < left + leftHalo){
+                ghostsToLeft.push_back(ball);
+            }
+            if(ball.position.x >= right - rightHalo){
+                ghostsToRight.push_back(ball);
+            }
+        }
+        if(!exchangeWithNeighbours(rank, leftLink, rightLink, ghostsToLeft, ghostsToRight, ghostsFromLeft, ghostsFromRight)){
+            std::cout << "Domain " << rank << ": lost connection to a neighbour" << std::endl;
+            break;
+        }
+        int owned = scene.ballArray.size();
+        scene.ballArray.insert(scene.ballArray.end(), ghostsFromLeft.begin(), ghostsFromLeft.end());
+        scene.ballArray.insert(scene.ballArray.end(), ghostsFromRight.begin(), ghostsFromRight.end());
+        stats.ghosts = scene.ballArray.size() - owned;
+        // ghosts get placeholder render and info entries and their own handles, so they can be found after the step
+        for(int i = owned; i < scene.ballArray.size(); i++){
+            const Ball &ghost = scene.ballArray[i];
+            scene.renderArray.push_back(BallRender{quantizeRadius(ghost.radius), 0});
+            scene.infoArray.push_back(BallInfo{GRAY, 1.0f / ghost.inverse_mass});
+        }
+        registerSpawnedBalls(scene, owned, 0.0f);
+        ghostSlots.assign(scene.handles.indices.size(), false);
+        for(int i = owned; i < scene.infoArray.size(); i++){
+            ghostSlots[scene.infoArray[i].slot] = true;
+        }
+
+        // ball indices change every step, so sleeping balls cannot keep their island links
+        islands.parent.resize(scene.ballArray.size());
+        for(int i = 0; i < islands.parent.size(); i++){
+            islands.parent[i] = i;
+        }
+        scene.physics.contactCache.clear();
+        stepScene(scene);
+        despawnBalls(scene, [&](int i){
+            return ghostSlots[scene.infoArray[i].slot];
+        });
+        owned = scene.ballArray.size();
+
+        toLeft.clear();
+        toRight.clear();
+        int kept = 0;
+        for(int i = 0; i < owned; i++){
+            MigratingBall migrating = {scene.ballArray[i], scene.renderArray[i], scene.infoArray[i]};
+            if(migrating.ball.position.x < left && leftLink.fd >= 0){
+                toLeft.push_back(migrating);
+            }
+            else if(migrating.ball.position.x >= right && rightLink.fd >= 0){
+                toRight.push_back(migrating);
+            }
+            else{
+                scene.ballArray[kept] = migrating.ball;
+                scene.renderArray[kept] = migrating.render;
+                scene.infoArray[kept] = migrating.info;
+                kept++;
+            }
+        }
+        stats.migrated += owned - kept;
+        scene.ballArray.resize(kept);
+        scene.renderArray.resize(kept);
+        scene.infoArray.resize(kept);
+        if(!exchangeWithNeighbours(rank, leftLink, rightLink, toLeft, toRight, fromLeft, fromRight)){
+            std::cout << "Domain " << rank << ": lost connection to a neighbour" << std::endl;
+            break;
+        }
+        for(const std::vector<MigratingBall> *arrivals : {&fromLeft, &fromRight}){
+            for(const MigratingBall &migrating : *arrivals){
+                scene.ballArray.push_back(migrating.ball);
+                scene.renderArray.push_back(migrating.render);
+                scene.infoArray.push_back(migrating.info);
+            }
+        }
+        scene.handles.rebuild(scene.infoArray);
+    }
+
+    stats.balls = scene.ballArray.size();
+    for(const Ball &ball : scene.ballArray){
+        stats.kineticEnergy += 0.5f * Vector2LengthSqr(ball.velocity) / ball.inverse_mass;
+    }
+    stats.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return stats;
+}
+
+// Splits the world into vertical strips, one forked worker process each; must run before the worker pool starts.
+void runDomains(const DomainOptions &domain, const SimulationSettings &settings, uint64_t seed){
+    int count = domain.processes;
+    int columns = std::max(1, (int)std::ceil(settings.world.x / domain.cellSize));
+    count = std::min(count, columns);
+    std::vector<int> neighbourSockets(2 * (count - 1));
+    std::vector<int> resultSockets(2 * count);
+    for(int i = 0; i + 1 < count; i++){
+        socketpair(AF_UNIX, SOCK_STREAM, 0, &neighbourSockets[2 * i]);
+    }
+    for(int i = 0; i < count; i++){
+        socketpair(AF_UNIX, SOCK_STREAM, 0, &resultSockets[2 * i]);
+    }
+    std::cout.flush();
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<pid_t> children;
+    for(int rank = 0; rank < count; rank++){
+        pid_t pid = fork();
+        if(pid == 0){
+            DomainLink leftLink, rightLink;
+            if(rank > 0){
+                leftLink.fd = neighbourSockets[2 * (rank - 1) + 1];
+            }
+            if(rank + 1 < count){
+                rightLink.fd = neighbourSockets[2 * rank];
+                rightLink.sendsFirst = true;
+            }
+            float left = columns * rank / count * domain.cellSize;
+            float right = rank + 1 < count ? columns * (rank + 1) / count * domain.cellSize : settings.world.x;
+            DomainStats stats = runDomain(rank, left, right, leftLink, rightLink, domain, settings, seed + rank);
+            writeAll(resultSockets[2 * rank + 1], &stats, sizeof(stats));
+            std::cout.flush();
+            _exit(0);
+        }
+        children.push_back(pid);
+    }
+
+    std::cout << "domain,balls,ghosts,migrated,kineticEnergy,ms" << std::endl;
+    DomainStats total;
+    for(int rank = 0; rank < count; rank++){
+        DomainStats stats;
+        if(!readAll(resultSockets[2 * rank], &stats, sizeof(stats))){
+            std::cout << rank << ",failed" << std::endl;
+            continue;
+        }
+        std::cout << rank << "," << stats.balls << "," << stats.ghosts << "," << stats.migrated << "," << stats.kineticEnergy << "," << stats.milliseconds << std::endl;
+        total.balls += stats.balls;
+        total.ghosts += stats.ghosts;
+        total.migrated += stats.migrated;
+        total.kineticEnergy += stats.kineticEnergy;
+    }
+    for(pid_t child : children){
+        waitpid(child, nullptr, 0);
+    }
+    for(int fd : neighbourSockets){
+        close(fd);
+    }
+    for(int fd : resultSockets){
+        close(fd);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "# " << count << " domains, " << total.balls << " balls, " << total.migrated << " migrations, kinetic energy "
+              << total.kineticEnergy << ", " << domain.steps << " steps in " << seconds << " s" << std::endl;
+}
+#else
+void runDomains(const DomainOptions &domain, const SimulationSettings &settings, uint64_t seed){
+    std::cout << "--domains needs fork and Unix sockets, which this platform does not provide" << std::endl;
+}
+#endif
+
+// Level file: "segment x1 y1 x2 y2", "rect x y width height" or convex "poly x1 y1 ..." per line; "demo" is built in.
+bool loadLevel(StaticGeometry &geometry, const std::string &path, Vector2 world){
+    if(path == "demo"){
+        // drawn for the default window and stretched to the world; the hexagon rows keep their spacing and fill the width
+        float sx = world.x / WINDOW_WIDTH;
+        float sy = world.y / WINDOW_HEIGHT;
+        geometry.addSegment(Vector2{80 * sx, 140 * sy}, Vector2{460 * sx, 260 * sy});
+        geometry.addSegment(Vector2{world.x - 80 * sx, 140 * sy}, Vector2{world.x - 460 * sx, 260 * sy});
+        geometry.addRectangle(Rectangle{140 * sx, 430 * sy, 160 * sx, 30 * sy});
+        geometry.addRectangle(Rectangle{world.x - 300 * sx, 430 * sy, 160 * sx, 30 * sy});
+        for(int row = 0; row < 2; row++){
+            for(float x = 80 + row * 40; x < world.x - 40; x += 80){
+                std::vector<Vector2> hexagon;
+                for(int corner = 0; corner < 6; corner++){
+                    float angle = corner * PI / 3.0f;
+                    hexagon.push_back(Vector2{x + 14 * std::cos(angle), 560 * sy + row * 70 + 14 * std::sin(angle)});
+                }
+                geometry.addPolygon(hexagon);
+            }
+        }
+        geometry.build();
+        return true;
+    }
+    FILE *file = std::fopen(path.c_str(), "r");
+    if(file == nullptr){
+        return false;
+    }
+    char line[4096];
+    int lineNumber = 0;
+    while(std::fgets(line, sizeof(line), file) != nullptr){
+        lineNumber++;
+        char kind[16];
+        int used = 0;
+        if(std::sscanf(line, " %15s%n", kind, &used) != 1 || kind[0] == '#'){
+            continue;
+        }
+        std::vector<float> values;
+        char *cursor = line + used;
+        while(true){
+            char *end = cursor;
+            float value = std::strtof(cursor, &end);
+            if(end == cursor){
+                break;
+            }
+            values.push_back(value);
+            cursor = end;
+        }
+        bool added = false;
+        if(std::strcmp(kind, "segment") == 0 && values.size() == 4){
+            geometry.addSegment(Vector2{values[0], values[1]}, Vector2{values[2], values[3]});
+            added = true;
+        }
+        else if(std::strcmp(kind, "rect") == 0 && values.size() == 4){
+            geometry.addRectangle(Rectangle{values[0], values[1], values[2], values[3]});
+            added = true;
+        }
+        else if(std::strcmp(kind, "poly") == 0 && values.size() >= 6 && values.size() % 2 == 0){
+            std::vector<Vector2> points;
+            for(int i = 0; i < values.size(); i += 2){
+                points.push_back(Vector2{values[i], values[i + 1]});
+            }
+            added = geometry.addPolygon(points);
+        }
+        if(!added){
+            std::cout << path << ":" << lineNumber << ": skipped, not a segment, rect or convex poly" << std::endl;
+        }
+    }
+    std::fclose(file);
+    geometry.build();
+    return true;
+}
+
+// Spawns and settles a fresh scene as fast as possible before the window shows it.
+void prewarmScene(Scene &scene, int spawns){
+    if(spawns <= 0){
+        return;
+    }
+    const int stepsBetweenSpawns = 30;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for(int i = 0; i < spawns * 2; i++){
+        if(i < spawns){
+            applySceneCommand(scene, COMMAND_SPAWN);
+        }
+        for(int step = 0; step < stepsBetweenSpawns; step++){
+            stepScene(scene);
+        }
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "Prewarmed " << scene.ballArray.size() << " balls in " << scene.stepCount << " steps, " << elapsed.count() << " ms" << std::endl;
+}
+
+// Checks Philox known answers, grid queries against brute force, and snapshot and rewind round trips; true if all pass.
+bool runSelfTest(uint64_t seed){
+    int failures = 0;
+    struct KnownAnswer { uint64_t key; uint64_t stream; uint64_t block; uint32_t expected[4]; };
+    const KnownAnswer knownAnswers[3] = {
+        {0, 0, 0, {0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8}},
+        {~0ull, ~0ull, ~0ull, {0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd}},
+        {0x299f31d0a4093822ull, 0x0370734413198a2eull, 0x85a308d3243f6a88ull, {0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1}},
+    };
+    for(const KnownAnswer &answer : knownAnswers){
+        uint32_t out[4];
+        PhiloxRandom(answer.key, answer.stream).block(answer.block, out);
+        if(std::memcmp(out, answer.expected, sizeof(out)) != 0){
+            failures++;
+            std::cout << "Self-test: Philox4x32-10 differs for key " << std::hex << answer.key << std::dec << std::endl;
+        }
+    }
+
+    Scene scene(seed);
+    for(int n = 0; n < 40; n++){
+        applySceneCommand(scene, COMMAND_SPAWN);
+    }
+    for(int step = 0; step < 200; step++){
+        stepScene(scene);
+    }
+    std::vector<Ball> &ballArray = scene.ballArray;
+    PhiloxRandom random(seed, 0);
+    int *edgeBalls = LoadSimRandomSequence(3, 0, ballArray.size() - 1, random);
+    ballArray[edgeBalls[0]].position = Vector2{491.0f, -0.2f};
+    ballArray[edgeBalls[1]].position = Vector2{-4.0f, 300.0f};
+    ballArray[edgeBalls[2]].position = Vector2{scene.settings.world.x + 3.0f, scene.settings.world.y + 3.0f};
+    for(int k = 0; k < 3; k++){
+        ballArray[edgeBalls[k]].radius = MAX_BALL_RADIUS;
+    }
+    updateCellContents(scene.grid, ballArray);
+
+    auto check = [&](bool passed, const char *query, Vector2 point){
+        if(!passed){
+            failures++;
+            std::cout << "Self-test: " << query << " differs at " << point.x << ", " << point.y << std::endl;
+        }
+    };
+    RaycastHit hit;
+    check(raycastBalls(scene.grid, ballArray, Vector2{541.0f, -24.0f}, Vector2{-1.0f, 0.0f}, 100.0f, hit) && hit.ball == edgeBalls[0], "raycast", Vector2{541.0f, -24.0f});
+    UnloadRandomSequence(edgeBalls);
+
+    std::vector<int> found;
+    std::vector<int> expected;
+    for(int query = 0; query < 2000; query++){
+        Vector2 point = {random.nextFloat() * (scene.settings.world.x + 320.0f) - 160.0f, random.nextFloat() * (scene.settings.world.y + 320.0f) - 160.0f};
+
+        float radius = random.nextFloat() * 120.0f;
+        queryRadius(scene.grid, ballArray, point, radius, found);
+        expected.clear();
+        for(int k = 0; k < ballArray.size(); k++){
+            float reach = radius + ballArray[k].radius;
+            if(Vector2DistanceSqr(ballArray[k].position, point) <= reach * reach){
+                expected.push_back(k);
+            }
+        }
+        std::sort(found.begin(), found.end());
+        check(found == expected, "queryRadius", point);
+
+        Rectangle area = {point.x, point.y, random.nextFloat() * 300.0f, random.nextFloat() * 300.0f};
+        queryRectangle(scene.grid, ballArray, area, found);
+        expected.clear();
+        for(int k = 0; k < ballArray.size(); k++){
+            Vector2 closest = {Clamp(ballArray[k].position.x, area.x, area.x + area.width), Clamp(ballArray[k].position.y, area.y, area.y + area.height)};
+            if(Vector2DistanceSqr(closest, ballArray[k].position) <= ballArray[k].radius * ballArray[k].radius){
+                expected.push_back(k);
+            }
+        }
+        std::sort(found.begin(), found.end());
+        check(found == expected, "queryRectangle", point);
+
+        // compared by distance, since equally distant balls may come out in either order
+        int count = random.nextInt(1, 20);
+        queryNearest(scene.grid, ballArray, point, count, found);
+        std::vector<float> distances;
+        for(const Ball &ball : ballArray){
+            distances.push_back(Vector2DistanceSqr(ball.position, point));
+        }
+        std::sort(distances.begin(), distances.end());
+        bool nearestMatches = found.size() == std::min(count, (int)ballArray.size());
+        for(int n = 0; nearestMatches && n < found.size(); n++){
+            nearestMatches = Vector2DistanceSqr(ballArray[found[n]].position, point) == distances[n];
+        }
+        check(nearestMatches, "queryNearest", point);
+
+        Vector2 direction = {random.nextFloat() * 2.0f - 1.0f, random.nextFloat() * 2.0f - 1.0f};
+        float maxDistance = random.nextFloat() * 1500.0f;
+        bool gotHit = raycastBalls(scene.grid, ballArray, point, direction, maxDistance, hit);
+        float nearest = -1.0f;
+        for(const Ball &ball : ballArray){
+            float t = rayCircleIntersection(point, Vector2Normalize(direction), ball.position, ball.radius);
+            if(t >= 0.0f && t <= maxDistance && (nearest < 0.0f || t < nearest)){
+                nearest = t;
+            }
+        }
+        check(gotHit == (nearest >= 0.0f) && (!gotHit || std::abs(hit.distance - nearest) <= 1e-4f * (1.0f + nearest)), "raycastBalls", point);
+    }
+
+    Emitter emitter;
+    emitter.position = Vector2Scale(scene.settings.world, 0.5f);
+    scene.emitters.push_back(emitter);
+    for(int step = 0; step < 10; step++){
+        stepScene(scene);
+    }
+    std::string snapshotPath = scene.snapshotPath + ".test";
+    Scene restored(seed + 1);
+    bool roundTrip = saveSceneSnapshot(scene, snapshotPath) && loadSceneSnapshot(restored, snapshotPath);
+    std::remove(snapshotPath.c_str());
+    roundTrip = roundTrip && hashBallState(restored.ballArray) == hashBallState(scene.ballArray) && restored.stepCount == scene.stepCount &&
+                restored.renderArray.size() == scene.renderArray.size() && restored.emitters.size() == scene.emitters.size() &&
+                std::memcmp(restored.renderArray.data(), scene.renderArray.data(), scene.renderArray.size() * sizeof(BallRender)) == 0 &&
+                std::memcmp(restored.infoArray.data(), scene.infoArray.data(), scene.infoArray.size() * sizeof(BallInfo)) == 0 &&
+                std::memcmp(restored.emitters.data(), scene.emitters.data(), scene.emitters.size() * sizeof(Emitter)) == 0;
+    if(!roundTrip){
+        failures++;
+        std::cout << "Self-test: snapshot differs after saving and loading" << std::endl;
+    }
+
+    // short-lived emitted balls give delta frames with spawns both in place and remapped around despawns
+    Scene recorded(seed);
+    recorded.rewind.capacity = 64;
+    for(int n = 0; n < 4; n++){
+        applySceneCommand(recorded, COMMAND_SPAWN);
+    }
+    emitter.lifetime = 0.1f;
+    recorded.emitters.push_back(emitter);
+    for(int step = 0; step < 40; step++){
+        stepScene(recorded);
+    }
+    RewindBuffer &rewind = recorded.rewind;
+    bool spawnsInPlace = false;
+    bool spawnsRemapped = false;
+    for(const RewindFrame &frame : rewind.frames){
+        bool spawns = !frame.keyframe && frame.ballCount > frame.keptCount;
+        spawnsInPlace = spawnsInPlace || (spawns && !frame.remapped);
+        spawnsRemapped = spawnsRemapped || (spawns && frame.remapped);
+    }
+    rewind.seek(rewind.frames.size() - 1);
+    const RewindState &decoded = rewind.cursor;
+    bool rewound = spawnsInPlace && spawnsRemapped && hashBallState(decoded.balls) == hashBallState(rewind.last.balls) &&
+                   decoded.render.size() == recorded.renderArray.size() && decoded.info.size() == recorded.infoArray.size() &&
+                   std::memcmp(decoded.render.data(), recorded.renderArray.data(), recorded.renderArray.size() * sizeof(BallRender)) == 0 &&
+                   std::memcmp(decoded.info.data(), recorded.infoArray.data(), recorded.infoArray.size() * sizeof(BallInfo)) == 0;
+    if(!rewound){
+        failures++;
+        std::cout << "Self-test: rewind history does not decode to the recorded state" << std::endl;
+    }
+    std::cout << "Self-test: " << failures << " failures" << std::endl;
+    return failures == 0;
+}
+
+struct LaunchOptions
+{
+    bool deterministic = false; // physics on the window thread, one step per frame, fixed seed, state hash printed every second
+    bool seeded = false;
+    uint64_t seed = 0;
+    int threads = 0;
+    int steps = 0;              // quit after this many physics steps, 0 runs until the window closes
+    float physicsRate = FPS;    // physics steps per second, independent of the display rate
+    int fastForward = 8;        // speed multiplier toggled with X
+    bool startFastForward = false;
+    int prewarmSpawns = 0;
+    bool gravity = false;       // start in gravity mode
+    BatchOptions batch;         // scenes > 0 runs a headless batch instead of opening the window
+    DomainOptions domain;       // processes > 0 runs one headless scene split over that many processes
+    std::string publishName;    // POSIX shared memory object to publish ball state to, e.g. /balls
+    int publishCapacity = 1 << 16;
+    std::string readName;       // attach to another instance's published state instead of simulating
+    std::string snapshotPath;   // F5 saves here and F9 loads it; --load also starts from it
+    float rewindSeconds = 10.0f;  // history kept for rewinding, 0 turns recording off
+    int eventCapacity = 4096;     // collision events queued for the window before new ones are dropped
+    float eventThreshold = 300.0f; // weakest impulse reported as a collision event
+    bool loadSnapshot = false;
+    std::string levelPath;        // static obstacles, see loadLevel
+    float ballLifetime = 0.0f;    // seconds before balls are despawned, 0 keeps them
+    bool despawnOffscreen = false;
+    std::vector<Emitter> emitters;
+    float emitterLifetime = 0.0f; // seconds before emitted balls are despawned, for every emitter; 0 keeps them
+    float cellSize = 0.0f;        // fixed grid cell size; 0 lets the tuner pick one, except in deterministic runs
+    Vector2 world = {0.0f, 0.0f}; // fixed world size; 0 follows the window
+    bool selfTest = false;        // run the built-in checks, see runSelfTest, and exit
+};
+
+LaunchOptions parseLaunchOptions(int argc, char **argv){
+    LaunchOptions options;
+    for(int i = 1; i < argc; i++){
+        bool hasValue = i + 1 < argc;
+        if(std::strcmp(argv[i], "--deterministic") == 0){
+            options.deterministic = true;
+        }
+        else if(std::strcmp(argv[i], "--seed") == 0 && hasValue){
+            options.seed = std::strtoull(argv[++i], nullptr, 10);
+            options.seeded = true;
+        }
+        else if(std::strcmp(argv[i], "--threads") == 0 && hasValue){
+            options.threads = std::atoi(argv[++i]);
+        }
+        else if(std::strcmp(argv[i], "--steps") == 0 && hasValue){
+            options.steps = std::atoi(argv[++i]);
+        }
+        else if(std::strcmp(argv[i], "--fast-forward") == 0 && hasValue){
+            options.fastForward = std::max(1, std::atoi(argv[++i]));
+            options.startFastForward = true;
+        }
+        else if(std::strcmp(argv[i], "--prewarm") == 0 && hasValue){
+            options.prewarmSpawns = std::atoi(argv[++i]);
+        }
+        else if(std::strcmp(argv[i], "--gravity") == 0){
+            options.gravity = true;
+        }
+        else if(std::strcmp(argv[i], "--world") == 0 && i + 2 < argc){
+            options.world.x = std::max(2.0f * MAX_BALL_RADIUS, (float)std::atof(argv[++i]));
+            options.world.y = std::max(2.0f * MAX_BALL_RADIUS, (float)std::atof(argv[++i]));
+        }
+        else if(std::strcmp(argv[i], "--cell-size") == 0 && hasValue){
+            options.cellSize = std::atof(argv[++i]);
+        }
+        else if(std::strcmp(argv[i], "--lifetime") == 0 && hasValue){
+            options.ballLifetime = std::atof(argv[++i]);
+        }
+        else if(std::strcmp(argv[i], "--emitter") == 0 && i + 3 < argc){
+            Emitter emitter;
+            emitter.position.x = std::atof(argv[++i]);
+            emitter.position.y = std::atof(argv[++i]);
+            emitter.rate = std::atof(argv[++i]);
+            options.emitters.push_back(emitter);
+        }
+        else if(std::strcmp(argv[i], "--emitter-lifetime") == 0 && hasValue){
+            options.emitterLifetime = std::atof(argv[++i]);
+        }
+        else if(std::strcmp(argv[i], "--despawn-offscreen") == 0){
+            options.despawnOffscreen = true;
+        }
+        else if(std::strcmp(argv[i], "--level") == 0 && hasValue){
+            options.levelPath = argv[++i];
+        }
+        else if(std::strcmp(argv[i], "--batch") == 0 && hasValue){
+            options.batch.scenes = std::atoi(argv[++i]);
+        }
+        else if(std::strcmp(argv[i], "--batch-steps") == 0 && hasValue){
+            options.batch.steps = std::atoi(argv[++i]);
+        }
+        else if(std::strcmp(argv[i], "--batch-spawns") == 0 && i + 2 < argc){
+            options.batch.spawnsMin = std::atoi(argv[++i]);
+            options.batch.spawnsMax = std::atoi(argv[++i]);
+        }
+        else if(std::strcmp(argv[i], "--batch-elasticity") == 0 && i + 2 < argc){
+            options.batch.elasticityMin = std::atof(argv[++i]);
+            options.batch.elasticityMax = std::atof(argv[++i]);
+        }
+        else if(std::strcmp(argv[i], "--domains") == 0 && hasValue){
+            options.domain.processes = std::atoi(argv[++i]);
+        }
+        else if(std::strcmp(argv[i], "--domain-steps") == 0 && hasValue){
+            options.domain.steps = std::atoi(argv[++i]);
+        }
+        else if(std::strcmp(argv[i], "--domain-spawns") == 0 && hasValue){
+            options.domain.spawns = std::atoi(argv[++i]);
+        }
+        else if(std::strcmp(argv[i], "--publish") == 0 && hasValue){
+            options.publishName = argv[++i];
+        }
+        else if(std::strcmp(argv[i], "--publish-capacity") == 0 && hasValue){
+            options.publishCapacity = std::max(1, std::atoi(argv[++i]));
+        }
+        else if(std::strcmp(argv[i], "--read") == 0 && hasValue){
+            options.readName = argv[++i];
+        }
+        else if(std::strcmp(argv[i], "--snapshot") == 0 && hasValue){
+            options.snapshotPath = argv[++i];
+        }
+        else if(std::strcmp(argv[i], "--load") == 0 && hasValue){
+            options.snapshotPath = argv[++i];
+            options.loadSnapshot = true;
+        }
+        else if(std::strcmp(argv[i], "--rewind") == 0 && hasValue){
+            options.rewindSeconds = std::max(0.0f, (float)std::atof(argv[++i]));
+        }
+        else if(std::strcmp(argv[i], "--event-capacity") == 0 && hasValue){
+            options.eventCapacity = std::max(1, std::atoi(argv[++i]));
+        }
+        else if(std::strcmp(argv[i], "--event-threshold") == 0 && hasValue){
+            options.eventThreshold = std::atof(argv[++i]);
+        }
+        else if(std::strcmp(argv[i], "--self-test") == 0){
+            options.selfTest = true;
+        }
+        else if(std::strcmp(argv[i], "--physics-rate") == 0 && hasValue){
+            options.physicsRate = std::max(1.0f, (float)std::atof(argv[++i]));
+        }
+        else{
+            std::cout << "Unknown option: " << argv[i] << std::endl;
+        }
+    }
+    if(!options.seeded){
+        options.seed = options.deterministic ? 1 : (uint64_t)std::time(nullptr);
+    }
+    for(Emitter &emitter : options.emitters){
+        emitter.lifetime = options.emitterLifetime;
+    }
+    if(options.cellSize > 0.0f){
+        options.domain.cellSize = options.cellSize;
+    }
+    return options;
+}
+
+int main(int argc, char **argv)
 {
-    int elasticityCoefficient = 1.0f;
+    LaunchOptions options = parseLaunchOptions(argc, argv);
+    workerThreadCount = options.threads;
+    TIMESTEP = 1.0f / options.physicsRate;
+    SimulationSettings startSettings = options.gravity ? gravityModeSettings() : SimulationSettings();
+    if(options.world.x > 0.0f){
+        startSettings.world = options.world;
+    }
+    StaticGeometry level;
+    if(!options.levelPath.empty() && !loadLevel(level, options.levelPath, startSettings.world)){
+        std::cout << "Could not load level " << options.levelPath << std::endl;
+    }
+    if(options.selfTest){
+        return runSelfTest(options.seed) ? 0 : 1;
+    }
+    if(options.batch.scenes > 0){
+        runBatch(options.batch, startSettings, level, options.seed);
+        return 0;
+    }
+    if(options.domain.processes > 0){
+        runDomains(options.domain, startSettings, options.seed);
+        return 0;
+    }
+    if(!options.readName.empty()){
+        runSharedStateReader(options.readName);
+        return 0;
+    }
 
-    InitWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "OlivaresTamano - Exercise 5");
+    // the world follows the window as it is resized, unless --world fixed it
+    bool worldFollowsWindow = options.world.x <= 0.0f;
+    SetConfigFlags(FLAG_WINDOW_RESIZABLE);
+    InitWindow((int)startSettings.world.x, (int)startSettings.world.y, "OlivaresTamano - Exercise 5");
 
     SetTargetFPS(FPS);
 
-    float accumulator = 0;
+    initializeBallPalette();
+    Scene scene(options.seed);
+    scene.settings = startSettings;
+    scene.physics.obstacles = level;
+    scene.ballLifetime = options.ballLifetime;
+    scene.despawnOffscreen = options.despawnOffscreen;
+    scene.emitters = options.emitters;
+    if(options.cellSize > 0.0f){
+        initializeAllCells(scene.grid, options.cellSize, scene.settings.world);
+    }
+    scene.cellTuner.enabled = options.cellSize <= 0.0f && !options.deterministic;
+    if(!options.snapshotPath.empty()){
+        scene.snapshotPath = options.snapshotPath;
+    }
+    scene.rewind.capacity = (int)(options.rewindSeconds * options.physicsRate);
+
+    if(options.loadSnapshot){
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if(loadSceneSnapshot(scene, scene.snapshotPath)){
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << "Loaded " << scene.ballArray.size() << " balls from " << scene.snapshotPath << " in " << elapsed.count() << " ms" << std::endl;
+        }
+        else{
+            std::cout << "Could not load " << scene.snapshotPath << std::endl;
+        }
+    }
+    CommandQueue commands;
+    SnapshotBuffer snapshots;
+    SimulationControl control;
+    bool fastForwarding = options.startFastForward;
+    control.stepsPerTick = fastForwarding ? options.fastForward : 1;
+    prewarmScene(scene, options.prewarmSpawns);
+    scene.physics.events.reset(new CollisionEventRing(options.eventCapacity, options.eventThreshold));
+    CollisionEventRing &collisionEvents = *scene.physics.events;
+    publishSnapshot(scene, snapshots);
+    SharedStatePublisher sharedState;
+    if(!options.publishName.empty() && !sharedState.open(options.publishName, options.publishCapacity)){
+        std::cout << "Could not publish shared state as " << options.publishName << std::endl;
+    }
+
+    // physics gets its own thread, except in deterministic runs, which step in lockstep with frames
+    std::thread simulationThread;
+    if(!options.deterministic){
+        simulationThread = std::thread([&]{ runSimulation(scene, commands, snapshots, sharedState, control, options.steps); });
+    }
+    std::vector<SceneCommand> frameCommands;
 
-    std::vector<Ball> ballArray;
-    int spawnInstance = 0;
-    
-    std::vector<std::vector<cell>> grid;
-    initializeAllCells(grid);
-   
     bool drawGrid = false;
+    bool drawCompact = true;
+    bool interpolate = true;
+    bool drawHits = true;
+    int drawnStep = -1;
+    PointerInput pointer;
+
+    // collision events drained every frame; each hard hit draws a ring that fades out
+    struct HitMarker
+    {
+        Vector2 position;
+        float impulse;
+        double time;
+    };
+    std::deque<HitMarker> hitMarkers;
+    int hitsThisSecond = 0;
+    int hitsPerSecond = 0;
+    double hitSecondStart = GetTime();
     while (!WindowShouldClose())
     {
-        
-        float delta_time = GetFrameTime();
-        Vector2 forces = Vector2Zero();
-        Vector2 mouseIndexLocation = getNearestIndexAtPoint(GetMousePosition());
-        if(IsMouseButtonDown(0)){
-            std::cout << "MOUSE INDEX: " << mouseIndexLocation.x << " " <<  mouseIndexLocation.y << std::endl;
-            std::cout << "SIZE OF CELL: " << grid[mouseIndexLocation.y][mouseIndexLocation.x].ballsInCell.size() << std::endl;
-        }
-
-        updateBallsIndex(ballArray);
-        updateCellContents(grid, ballArray);
         if (IsKeyPressed(KEY_TAB)){
             drawGrid = !drawGrid;
         }
+        if (IsKeyPressed(KEY_C)){
+            drawCompact = !drawCompact;
+        }
+        if (IsKeyPressed(KEY_I)){
+            interpolate = !interpolate;
+        }
+        if (IsKeyPressed(KEY_X)){
+            fastForwarding = !fastForwarding;
+            control.stepsPerTick = fastForwarding ? options.fastForward : 1;
+        }
+        if (IsKeyPressed(KEY_S)){
+            commands.push(COMMAND_CYCLE_SOLVER);
+        }
+        if (IsKeyPressed(KEY_N)){
+            commands.push(COMMAND_TOGGLE_NBODY);
+        }
+        if (IsKeyPressed(KEY_F)){
+            commands.push(COMMAND_TOGGLE_FLUID);
+        }
+        if (IsKeyPressed(KEY_G)){
+            commands.push(COMMAND_TOGGLE_GRAVITY);
+        }
         if (IsKeyPressed(KEY_SPACE))
         {
-            if (spawnInstance == 10)
-            {
-                InitializeBall(ballArray, 1, true);
-                spawnInstance = 0;
+            commands.push(COMMAND_SPAWN);
+        }
+        if (IsKeyPressed(KEY_F5)){
+            commands.push(COMMAND_SAVE_SNAPSHOT);
+        }
+        if (IsKeyPressed(KEY_F9)){
+            commands.push(COMMAND_LOAD_SNAPSHOT);
+        }
+        if (IsKeyPressed(KEY_H)){
+            drawHits = !drawHits;
+        }
+        if (IsKeyPressed(KEY_R)){
+            commands.push(COMMAND_TOGGLE_REWIND);
+        }
+        if (IsKeyPressed(KEY_E)){
+            commands.push(COMMAND_TOGGLE_EMITTERS);
+        }
+        // left mouse uses the current tool, T picks the next one and the wheel sizes the brush
+        if (IsKeyPressed(KEY_T)){
+            pointer.tool = (PointerTool)((pointer.tool + 1) % POINTER_TOOL_COUNT);
+        }
+        pointer.radius = Clamp(pointer.radius + GetMouseWheelMove() * 10.0f, 10.0f, 300.0f);
+        pointer.position = GetMousePosition();
+        pointer.held = IsMouseButtonDown(0);
+        commands.setPointer(pointer);
+        if (worldFollowsWindow && IsWindowResized()){
+            commands.setWorld(Vector2{(float)GetScreenWidth(), (float)GetScreenHeight()});
+        }
+        // held arrows scrub through the rewind history, shift scrubs faster
+        int scrubSteps = IsKeyDown(KEY_LEFT_SHIFT) ? 5 : 1;
+        for (int i = 0; i < scrubSteps; i++){
+            if (IsKeyDown(KEY_LEFT)){
+                commands.push(COMMAND_REWIND_BACK);
             }
-            else
-            {
-                InitializeBall(ballArray, 25, false);
-                spawnInstance++;
+            if (IsKeyDown(KEY_RIGHT)){
+                commands.push(COMMAND_REWIND_FORWARD);
             }
         }
-        
-        // Physics
-        accumulator += delta_time;
-        while (accumulator >= TIMESTEP)
-        {
-            checkCollisionInCell(grid, elasticityCoefficient, ballArray);
-            accumulator -= TIMESTEP;
+
+        if(options.deterministic){
+            commands.take(frameCommands);
+            for(SceneCommand command : frameCommands){
+                applySceneCommand(scene, command);
+            }
+            scene.pointer.input = commands.latestPointer();
+            Vector2 world;
+            if(commands.takeWorld(world)){
+                resizeWorld(scene, world);
+            }
+            for(int i = 0; i < control.stepsPerTick && !scene.rewinding; i++){
+                stepScene(scene);
+                if(scene.stepCount % (int)FPS == 0){
+                    std::cout << "step " << scene.stepCount << " balls " << scene.ballArray.size() << " hash " << std::hex << hashBallState(scene.ballArray) << std::dec << std::endl;
+                }
+            }
+            publishSnapshot(scene, snapshots);
+            sharedState.publish(scene);
+        }
+
+        double now = GetTime();
+        hitsThisSecond += collisionEvents.drain([&](const CollisionEvent &event){
+            hitMarkers.push_back(HitMarker{event.position, event.impulse, now});
+        });
+        while(!hitMarkers.empty() && (hitMarkers.size() > 256 || now - hitMarkers.front().time > 0.25)){
+            hitMarkers.pop_front();
+        }
+        if(now - hitSecondStart >= 1.0){
+            hitsPerSecond = hitsThisSecond;
+            hitsThisSecond = 0;
+            hitSecondStart = now;
+        }
+
+        const RenderSnapshot &snapshot = snapshots.latest();
+        if(options.steps > 0 && snapshot.stepCount >= options.steps){
+            break;
+        }
+
+        // nothing new published and nothing to interpolate: skip drawing
+        bool interpolating = interpolate && !fastForwarding && !options.deterministic;
+        if(snapshot.stepCount == drawnStep && !interpolating && hitMarkers.empty()){
+            PollInputEvents();
+            WaitTime(1.0 / FPS);
+            continue;
+        }
+        drawnStep = snapshot.stepCount;
+
+        std::string numberOfBalls = std::to_string(snapshot.positions.size());
+
+        // draw part way from the previous step to the current one
+        float alpha = 1.0f;
+        if(interpolating){
+            std::chrono::duration<float> sincePublish = std::chrono::steady_clock::now() - snapshot.publishTime;
+            alpha = Clamp(sincePublish.count() / TIMESTEP, 0.0f, 1.0f);
         }
-        const char* numberOfBalls = std::to_string(ballArray.size()).c_str();
+        auto drawPosition = [&](int i){
+            if (i >= snapshot.previousPositions.size())
+            {
+                return snapshot.positions[i];
+            }
+            return Vector2Lerp(snapshot.previousPositions[i], snapshot.positions[i], alpha);
+        };
         
         BeginDrawing();
         ClearBackground(WHITE);
-        DrawText(numberOfBalls, 0, 0, 30, YELLOW);
-        for (int i = 0; i < ballArray.size(); i++)
-        {
-            DrawCircleV(ballArray[i].position, ballArray[i].radius, ballArray[i].color);
+        DrawText(numberOfBalls.c_str(), 0, 0, 30, YELLOW);
+        if(!snapshot.status.empty()){
+            DrawText(snapshot.status.c_str(), 0, 32, 20, DARKGRAY);
+        }
+        int overlayX = GetScreenWidth() - 260;
+        DrawText(TextFormat("hits %d/s  dropped %llu", hitsPerSecond, (unsigned long long)collisionEvents.dropped.load(std::memory_order_relaxed)), overlayX, 0, 20, DARKGRAY);
+        DrawText(TextFormat("%s  r %.0f  %d balls", pointerToolName(pointer.tool), pointer.radius, snapshot.pointerTouched), overlayX, 22, 20, DARKGRAY);
+        if(!snapshot.cellTuning.empty()){
+            DrawText(snapshot.cellTuning.c_str(), overlayX, 44, 20, DARKGRAY);
+        }
+        if(!worldFollowsWindow){
+            DrawRectangleLinesEx(Rectangle{0.0f, 0.0f, snapshot.world.x, snapshot.world.y}, 2.0f, LIGHTGRAY);
+        }
+        DrawCircleLinesV(pointer.position, pointer.radius, pointer.held ? MAROON : LIGHTGRAY);
+        if(drawHits){
+            for(const HitMarker &marker : hitMarkers){
+                float age = (now - marker.time) / 0.25;
+                DrawCircleLinesV(marker.position, 4.0f + age * std::min(40.0f, marker.impulse / 50.0f), Fade(ORANGE, 1.0f - age));
+            }
+        }
+        if(drawCompact){
+            for (int i = 0; i < snapshot.positions.size(); i++)
+            {
+                DrawCircleV(drawPosition(i), dequantizeRadius(snapshot.render[i].radius), ballPalette[snapshot.render[i].paletteIndex]);
+            }
+        }
+        else{
+            for (int i = 0; i < snapshot.positions.size(); i++)
+            {
+                DrawCircleV(drawPosition(i), snapshot.radii[i], snapshot.colors[i]);
+            }
+        }
+
+        // the level never changes, so the window draws its own copy
+        for(const Obstacle &obstacle : level.obstacles){
+            const Vector2 *points = &level.vertices[obstacle.firstVertex];
+            int edges = obstacle.vertexCount == 2 ? 1 : obstacle.vertexCount;
+            for(int i = 0; i < edges; i++){
+                DrawLineEx(points[i], points[(i + 1) % obstacle.vertexCount], 2.0f, DARKGRAY);
+            }
         }
 
         if(drawGrid){
-            for(int i = 0; i < grid.size(); i++){
-                for(int j = 0; j < grid[i].size(); j++){
-                    const char* numberOfBalsInCell = std::to_string(grid[i][j].ballsInCell.size()).c_str();
-                    Vector2 rectMidpoint = Vector2{getCenterOfRectangle(grid[i][j].position, cellSize, cellSize)};
-                    DrawText(numberOfBalsInCell, grid[i][j].max.x, grid[i][j].max.y, 5, PURPLE);
-                    DrawRectangleLines(grid[i][j].position.x, grid[i][j].position.y, cellSize, cellSize, grid[i][j].color);
-                }
+            for(const CellSnapshot &gridCell : snapshot.cells){
+                std::string numberOfBalsInCell = std::to_string(gridCell.ballCount);
+                DrawText(numberOfBalsInCell.c_str(), gridCell.position.x + snapshot.cellSize, gridCell.position.y, 5, PURPLE);
+                DrawRectangleLines(gridCell.position.x, gridCell.position.y, snapshot.cellSize, snapshot.cellSize, gridCell.color);
             }
         }
 
 
         EndDrawing();
     }
+    control.stop = true;
+    if(simulationThread.joinable()){
+        simulationThread.join();
+    }
     CloseWindow();
     return 0;
-}
\ No newline at end of file
+}